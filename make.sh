@@ -1,4 +1,4 @@
 mkdir build
 pushd build
-gcc ../src/main.c ../src/util.c -o main -g -Wall
+gcc ../src/main.c ../src/util.c -o main -g -O2 -Wall -pthread -lm
 popd
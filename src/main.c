@@ -1,7 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "util.h"
 
 #define GET_MACRO(_1, _2, NAME,...) NAME
@@ -11,11 +22,13 @@
 #define ASSERT2(expr, msg) if (!(expr)) {fprintf(stderr, msg); *(int*)0=0;}
 #define ASSERT(...) GET_MACRO(__VA_ARGS__, ASSERT2, ASSERT1)(__VA_ARGS__)
 
-#define IMG_QUANT_FAC 16
+#define IMG_QUANT_DEFAULT_FAC 16
 
 #define NUM_HUFF_SYMS 256
 // Know we need 2n - 1 nodes for a tree with n leaves and no half-filled nodes
 #define NUM_HUFF_NODES (NUM_HUFF_SYMS * 2 - 1)
+// Longest Huffman code allowed, codes get length limited down to this
+#define HUFF_MAX_CODE_LEN 15
 
 /*
  *  Compression Ratios:
@@ -29,73 +42,377 @@
 
 typedef uint8_t u8;
 
-typedef struct BitFile {
+/*
+ *  Bit streams
+ *
+ *  Bits are packed most significant first. A 64 bit accumulator holds pending bits
+ *  so whole codes are written and peeked at once, and bytes move through a large
+ *  in-memory buffer. If the stream has a file, the buffer is flushed to / refilled
+ *  from it in blocks, otherwise the stream just wraps the caller's buffer.
+ */
+#define BS_BUF_SIZE (1 << 20)
+
+typedef struct BitStream {
     FILE* fp;
-    char buffer;
-    u8 count;
-    
-} BitFile;
+    u8* buf;
+    size_t cap;
+    // Next byte to write or read
+    size_t pos;
+    // Number of valid bytes in buf when reading
+    size_t end;
+    // Writing: pending bits right aligned. Reading: buffered bits left aligned.
+    uint64_t acc;
+    int nBits;
+    int ownsBuf;
+} BitStream;
+
+
+static inline uint64_t readBE64(const u8* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return __builtin_bswap64(v);
+}
+
+
+static inline void writeBE32(u8* p, uint32_t v) {
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, 4);
+}
+
+
+void bsWriterFromBuffer(BitStream* bs, u8* buf, size_t cap) {
+    bs->fp = NULL;
+    bs->buf = buf;
+    bs->cap = cap;
+    bs->pos = 0;
+    bs->end = 0;
+    bs->acc = 0;
+    bs->nBits = 0;
+    bs->ownsBuf = 0;
+}
+
+
+void bsWriterFromFilePtr(BitStream* bs, FILE* fp) {
+    u8* buf = (u8*) malloc(BS_BUF_SIZE);
+    ASSERT(buf, "Error: Out of memory allocating bit stream buffer.\n");
+    bsWriterFromBuffer(bs, buf, BS_BUF_SIZE);
+    bs->fp = fp;
+    bs->ownsBuf = 1;
+}
+
+
+void bsReaderFromBuffer(BitStream* bs, const u8* buf, size_t size) {
+    bs->fp = NULL;
+    bs->buf = (u8*) buf;
+    bs->cap = size;
+    bs->pos = 0;
+    bs->end = size;
+    bs->acc = 0;
+    bs->nBits = 0;
+    bs->ownsBuf = 0;
+}
+
+
+void bsReaderFromFilePtr(BitStream* bs, FILE* fp) {
+    u8* buf = (u8*) malloc(BS_BUF_SIZE);
+    ASSERT(buf, "Error: Out of memory allocating bit stream buffer.\n");
+    bsReaderFromBuffer(bs, buf, BS_BUF_SIZE);
+    bs->end = 0;
+    bs->fp = fp;
+    bs->ownsBuf = 1;
+}
+
+
+void bsFlushBuffer(BitStream* bs) {
+    ASSERT(bs->fp, "Error: Bit stream buffer overflow.\n");
+    size_t written = fwrite(bs->buf, 1, bs->pos, bs->fp);
+    ASSERT(written == bs->pos, "Error: Failed writing bit stream.\n");
+    bs->pos = 0;
+}
 
 
-int bfRead(BitFile* bfp) {
-    if (bfp->count == 0) {
-        int c = fgetc(bfp->fp);
-        if (c == EOF) {
-            return c;
+// Write the low 'len' bits of 'code', len must be at most 32
+static inline void bsPutBits(BitStream* bs, uint32_t code, int len) {
+    bs->acc = (bs->acc << len) | code;
+    bs->nBits += len;
+    if (bs->nBits >= 32) {
+        if (bs->pos + 4 > bs->cap) {
+            bsFlushBuffer(bs);
         }
-        bfp->buffer = (char) c;
-        bfp->count = 8;
+        bs->nBits -= 32;
+        writeBE32(bs->buf + bs->pos, (uint32_t) (bs->acc >> bs->nBits));
+        bs->pos += 4;
     }
-    bfp->count--;
-    return (int) ((bfp->buffer >> bfp->count) & 1);
 }
 
 
-void bfWrite(char c, BitFile* bfp) {
-    // Set next buffer bit on if c is not 0
-    bfp->buffer |= (((c != 0) << (7-bfp->count)));
-    bfp->count++;
-    if (bfp->count == 8) {
-        fputc(bfp->buffer, bfp->fp);
-        bfp->buffer = 0x00;
-        bfp->count = 0;
+// Write out pending bits, zero padding the last byte. Returns the bytes in the buffer.
+size_t bsFlush(BitStream* bs) {
+    while (bs->nBits > 0) {
+        if (bs->pos == bs->cap) {
+            bsFlushBuffer(bs);
+        }
+        int shift = bs->nBits - 8;
+        bs->buf[bs->pos++] = (u8) (shift >= 0 ? bs->acc >> shift : bs->acc << -shift);
+        bs->nBits = shift > 0 ? shift : 0;
+    }
+    if (bs->fp) {
+        bsFlushBuffer(bs);
+    }
+    return bs->pos;
+}
+
+
+void bsWriteClose(BitStream* bs) {
+    bsFlush(bs);
+    if (bs->ownsBuf) {
+        free(bs->buf);
     }
 }
 
 
-void bfWriteClose(BitFile* bfp) {
-    // Force caller to handle padding
-    ASSERT(bfp->count == 0, "Bit files must end on byte alignment.\n");
-    fclose(bfp->fp);
+void bsReadClose(BitStream* bs) {
+    if (bs->ownsBuf) {
+        free(bs->buf);
+    }
 }
 
-void bfReadClose(BitFile* bfp) {
-    fclose(bfp->fp);
+
+void bsRefillSlow(BitStream* bs) {
+    if (bs->fp && bs->pos + 8 > bs->end) {
+        // Move the unread tail to the front and top up from the file
+        size_t left = bs->end - bs->pos;
+        memmove(bs->buf, bs->buf + bs->pos, left);
+        bs->pos = 0;
+        bs->end = left + fread(bs->buf + left, 1, bs->cap - left, bs->fp);
+    }
+    while (bs->nBits <= 56 && bs->pos < bs->end) {
+        bs->acc |= ((uint64_t) bs->buf[bs->pos++]) << (56 - bs->nBits);
+        bs->nBits += 8;
+    }
 }
 
 
-void bfOpen(BitFile* bfp, const char* fname, const char* mode) {
-    bfp->fp = fopen(fname, mode);
-    bfp->buffer = 0x00;
-    bfp->count = 0;
+// Make sure at least 57 bits are buffered, unless the stream is running out
+static inline void bsRefill(BitStream* bs) {
+    if (bs->pos + 8 <= bs->end) {
+        // Bits past the whole bytes counted are loaded again by the next refill
+        bs->acc |= readBE64(bs->buf + bs->pos) >> bs->nBits;
+        bs->pos += (63 - bs->nBits) >> 3;
+        bs->nBits |= 56;
+    } else {
+        bsRefillSlow(bs);
+    }
 }
 
 
-void bfFromFilePtr(BitFile* bfp, FILE* fp) {
-    bfp->fp = fp;
-    bfp->buffer = 0x00;
-    bfp->count = 0;
+// Look at the next n bits (1 to 32) without consuming them. Past the end reads as 0.
+static inline uint32_t bsPeekBits(BitStream* bs, int n) {
+    return (uint32_t) (bs->acc >> (64 - n));
 }
 
 
-u8 getIthBit(u8 *bits, int i) {
-    return *(bits+i/8) & (0x80 >> (i%8));
+static inline void bsSkipBits(BitStream* bs, int n) {
+    bs->acc <<= n;
+    bs->nBits -= n;
 }
 
 
 typedef void (*TformPtr)(FILE*, FILE*);
 
 
+static inline uint32_t readLE32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static inline void writeLE32(u8* p, uint32_t v) {
+    p[0] = (u8) v;
+    p[1] = (u8) (v >> 8);
+    p[2] = (u8) (v >> 16);
+    p[3] = (u8) (v >> 24);
+}
+
+
+// 7 bits per byte, low bits first, top bit set on all but the last byte
+static inline int writeVarint(u8* p, uint64_t v) {
+    int i = 0;
+    while (v >= 0x80) {
+        p[i++] = (u8) (v | 0x80);
+        v >>= 7;
+    }
+    p[i++] = (u8) v;
+    return i;
+}
+
+
+static inline uint64_t readVarint(const u8** p, const u8* end) {
+    uint64_t v = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        ASSERT(*p < end, "Error: Varint runs past the end of the buffer.\n");
+        u8 b = *(*p)++;
+        v |= ((uint64_t) (b & 0x7f)) << shift;
+        if (b < 0x80) {
+            break;
+        }
+    }
+    return v;
+}
+
+
+/*
+ *  Block coding
+ *
+ *  Splits a stream into independent blocks which are coded in parallel on the thread
+ *  pool, a batch at a time so memory stays bounded. Each block is framed by its raw
+ *  and coded sizes (32 bit each). Blocks that don't shrink are stored as they are,
+ *  which is marked by the two sizes being equal. Codecs whose output is always
+ *  bigger (neverStore) can't produce equal sizes, so they skip this.
+ */
+typedef size_t (*BlockEncPtr)(const u8* in, size_t n, u8* out, size_t cap);
+typedef void (*BlockDecPtr)(const u8* in, size_t size, u8* out, size_t n);
+
+typedef struct BlockCodec {
+    BlockEncPtr encode;
+    BlockDecPtr decode;
+    size_t blockSize;
+    // Worst case coded size of a full block
+    size_t maxCodedSize;
+    // Readable bytes the decoder wants past the coded data (and the encoder past the raw)
+    size_t slack;
+    // Coded blocks are always a little bigger (transforms), so never store them
+    int neverStore;
+} BlockCodec;
+
+
+typedef struct BlockBatch {
+    const BlockCodec* codec;
+    u8** raw;
+    size_t* rawLens;
+    u8** coded;
+    size_t* codedLens;
+} BlockBatch;
+
+
+static void encodeBlockJob(void* ctx, int job) {
+    BlockBatch* b = (BlockBatch*) ctx;
+    size_t size = b->codec->encode(b->raw[job], b->rawLens[job], b->coded[job], b->codec->maxCodedSize);
+    ASSERT(size <= b->codec->maxCodedSize, "Error: Block coded past its worst case size.\n");
+    b->codedLens[job] = size;
+}
+
+
+static void decodeBlockJob(void* ctx, int job) {
+    BlockBatch* b = (BlockBatch*) ctx;
+    if (b->codedLens[job] == b->rawLens[job]) {
+        memcpy(b->raw[job], b->coded[job], b->rawLens[job]);
+    } else {
+        b->codec->decode(b->coded[job], b->codedLens[job], b->raw[job], b->rawLens[job]);
+    }
+}
+
+
+static void allocBlockBatch(BlockBatch* b, const BlockCodec* codec, int nBlocks) {
+    b->codec = codec;
+    b->raw = (u8**) malloc(nBlocks * sizeof(u8*));
+    b->coded = (u8**) malloc(nBlocks * sizeof(u8*));
+    b->rawLens = (size_t*) malloc(nBlocks * sizeof(size_t));
+    b->codedLens = (size_t*) malloc(nBlocks * sizeof(size_t));
+    ASSERT(b->raw && b->coded && b->rawLens && b->codedLens, "Error: Out of memory allocating blocks.\n");
+    for (int i=0; i < nBlocks; i++) {
+        b->raw[i] = (u8*) malloc(codec->blockSize + codec->slack);
+        b->coded[i] = (u8*) malloc(codec->maxCodedSize + codec->slack);
+        ASSERT(b->raw[i] && b->coded[i], "Error: Out of memory allocating blocks.\n");
+    }
+}
+
+
+static void freeBlockBatch(BlockBatch* b, int nBlocks) {
+    for (int i=0; i < nBlocks; i++) {
+        free(b->raw[i]);
+        free(b->coded[i]);
+    }
+    free(b->raw);
+    free(b->coded);
+    free(b->rawLens);
+    free(b->codedLens);
+}
+
+
+void blockCompress(FILE* infp, FILE* outfp, const BlockCodec* codec) {
+    ASSERT(codec->blockSize < UINT32_MAX && codec->maxCodedSize < UINT32_MAX, "Error: Block sizes must fit in 32 bits.\n");
+    int batchSize = 2 * numThreads();
+    BlockBatch b;
+    allocBlockBatch(&b, codec, batchSize);
+
+    int eof = 0;
+    while (!eof) {
+        int nBlocks = 0;
+        while (nBlocks < batchSize) {
+            size_t n = fread(b.raw[nBlocks], 1, codec->blockSize, infp);
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            memset(b.raw[nBlocks] + n, 0, codec->slack);
+            b.rawLens[nBlocks++] = n;
+        }
+
+        parallelFor(nBlocks, encodeBlockJob, &b);
+
+        for (int i=0; i < nBlocks; i++) {
+            u8 frame[8];
+            u8* data = b.coded[i];
+            if (b.codedLens[i] >= b.rawLens[i] && !codec->neverStore) {
+                // Store as is
+                b.codedLens[i] = b.rawLens[i];
+                data = b.raw[i];
+            }
+            writeLE32(frame, (uint32_t) b.rawLens[i]);
+            writeLE32(frame + 4, (uint32_t) b.codedLens[i]);
+            fwrite(frame, 1, 8, outfp);
+            fwrite(data, 1, b.codedLens[i], outfp);
+        }
+    }
+    freeBlockBatch(&b, batchSize);
+}
+
+
+void blockDecompress(FILE* infp, FILE* outfp, const BlockCodec* codec) {
+    int batchSize = 2 * numThreads();
+    BlockBatch b;
+    allocBlockBatch(&b, codec, batchSize);
+
+    int eof = 0;
+    while (!eof) {
+        int nBlocks = 0;
+        while (nBlocks < batchSize) {
+            u8 frame[8];
+            size_t got = fread(frame, 1, 8, infp);
+            if (got == 0) {
+                eof = 1;
+                break;
+            }
+            ASSERT(got == 8, "Error in blockDecompress: Unexpected end of file in block frame.\n");
+            size_t rawLen = readLE32(frame);
+            size_t codedLen = readLE32(frame + 4);
+            ASSERT(rawLen <= codec->blockSize && codedLen <= codec->maxCodedSize, "Error in blockDecompress: Corrupt block frame.\n");
+            ASSERT(fread(b.coded[nBlocks], 1, codedLen, infp) == codedLen, "Error in blockDecompress: Unexpected end of file in block.\n");
+            memset(b.coded[nBlocks] + codedLen, 0, codec->slack);
+            b.rawLens[nBlocks] = rawLen;
+            b.codedLens[nBlocks++] = codedLen;
+        }
+
+        parallelFor(nBlocks, decodeBlockJob, &b);
+
+        for (int i=0; i < nBlocks; i++) {
+            fwrite(b.raw[i], 1, b.rawLens[i], outfp);
+        }
+    }
+    freeBlockBatch(&b, batchSize);
+}
+
+
 typedef struct BMPFileHeader {
     int size;
     int imgOffset;
@@ -131,23 +448,44 @@ int readLittleEndian(FILE *fp, int offset, int nBytes) {
 void writeInt32(FILE *fp, int toWrite) {
     ASSERT(sizeof(int) == 4, "Error: Program assumes 'int' type is a 32 bit integer. The program needs refactoring if this is not the case\n");
     // Note little endian
-    fputc((char) toWrite & 0xFF, fp);
-    fputc((char) (toWrite >> 8) & 0xFF, fp);
-    fputc((char) (toWrite >> 16) & 0xFF, fp);
-    fputc((char) (toWrite >> 24) & 0xFF, fp);
-
+    u8 bytes[4];
+    for (int i=0; i < 4; i++) {
+        bytes[i] = (u8) (toWrite >> (8*i));
+    }
+    fwrite(bytes, 1, 4, fp);
 }
 
 
 int readInt32(FILE *fp) {
     ASSERT(sizeof(int) == 4, "Error: Program assumes 'int' type is a 32 bit integer. The program needs refactoring if this is not the case\n");
-    int res = 0;
-    int c;
+    u8 bytes[4];
+    ASSERT(fread(bytes, 1, 4, fp) == 4, "Error: End of file reached while reading int");
     // Note: little endian
-    for (int i=0; i < 4 && (c = fgetc(fp)) != EOF; i++) {
-        res |= (c << 8*i);
+    int res = 0;
+    for (int i=0; i < 4; i++) {
+        res |= (bytes[i] << 8*i);
+    }
+    return res;
+}
+
+
+void writeInt64(FILE *fp, uint64_t toWrite) {
+    // Note little endian
+    u8 bytes[8];
+    for (int i=0; i < 8; i++) {
+        bytes[i] = (u8) (toWrite >> (8*i));
+    }
+    fwrite(bytes, 1, 8, fp);
+}
+
+
+uint64_t readInt64(FILE *fp) {
+    u8 bytes[8];
+    ASSERT(fread(bytes, 1, 8, fp) == 8, "Error: End of file reached while reading int");
+    uint64_t res = 0;
+    for (int i=0; i < 8; i++) {
+        res |= ((uint64_t) bytes[i]) << (8*i);
     }
-    ASSERT(c != EOF, "Error: End of file reached while reading int");
     return res;
 }
 
@@ -164,161 +502,125 @@ void readBMPHeader(FILE *fp, BMPFileHeader *h) {
 }
 
 void copyBMPHeader(FILE* infp, FILE* outfp, BMPFileHeader* h) {
-    for (int i=0; i < h->imgOffset; i++) {
-        int c = fgetc(infp);
-        ASSERT(c != EOF, "Error: Unexpected end of file in header.\n");
-        fputc((char) c, outfp);
-    }
+    // Exactly the header, the caller reads the pixels from infp next
+    ASSERT(h->imgOffset >= 0, "Error: Bad image offset in header.\n");
+    u8* header = (u8*) malloc(h->imgOffset + 1);
+    ASSERT(header, "Error: Out of memory in copyBMPHeader.\n");
+    ASSERT(fread(header, 1, h->imgOffset, infp) == (size_t) h->imgOffset, "Error: Unexpected end of file in header.\n");
+    fwrite(header, 1, h->imgOffset, outfp);
+    free(header);
 }
 
 void copyRemaining(FILE* infp, FILE* outfp) {
-    int c;
-    while ((c = fgetc(infp)) != EOF) {
-        fputc((char) c, outfp);
+    ByteReader br;
+    brOpen(&br, infp);
+    const u8* span;
+    size_t n;
+    while ((n = brSpan(&br, &span)) > 0) {
+        fwrite(span, 1, n, outfp);
+        brSkip(&br, n);
     }
+    brClose(&br);
 }
 
 
-/* TODO delete once huffman refactor done
+// Image transforms hold this many bytes of rows at a time
+#define BMP_BAND_SIZE (1 << 20)
 
 
-
-*
- *  
- *
- *
-void printHuffTable(HuffTable* table) {
-    printf("Huff table:\n");
-    printf("Num entries: %d\n", table->nSym);
-    printf("Entry size: %d\n", table->entrySize);
-    printf("Codes:\n");
-    for (int i=0; i < table->nSym; i++) {
-        printf("  %i (length %i): ", i, table->codeLens[i]);
-        for (int j=0; j < table->codeLens[i]; j++) {
-            if ((table->codes[i*table->entrySize + j/8] & (0x80 >> (j%8))) == 0) {
-                printf("0");
-            } else {
-                printf("1");
-            }
-        }
-        printf("\n");
-    }
+// Bytes in a stored row, rows are padded to a multiple of 4
+size_t bmpRowBytes(BMPFileHeader* h) {
+    return (((size_t) h->width * h->bitsPerPixel + 31) / 32) * 4;
 }
 
 
-void dumpHuffTable(HuffTable* table) {
-    // HuffTable: 
-    //  int nSym;
-    //  int entrySize;
-    //  u8* codes;
-    //  int* codeLens;
-    printf("%d\n", table->nSym);
-    printf("%d\n", table->entrySize);
-    for (int i=0; i < table->nSym; i++) {
-        printf("%d\n", table->codeLens[i]);
-        for (int j = 0; j < table->entrySize; j++) {
-            printf("%x ", table->codes[table->entrySize * i + j]);
-        }
-        printf("\n");
-    }
+size_t bmpNumRows(BMPFileHeader* h) {
+    // Negative heights are top down images
+    return h->height < 0 ? -(size_t) h->height : (size_t) h->height;
 }
 
 
-void printHuffTree(HuffNode* root, int tabs) {
-    if (root != 0) {
-        if (root->left == 0 && root->right == 0) {
-            for (int i=0; i < tabs; i++) {
-                printf("  ");
-            }
-            printf("weight: %.4f  sym: %d\n", root->weight, root->sym);
-        } else {
-            for (int i=0; i < tabs; i++) {
-                printf("  ");
-            }
-            printf("weight: %.4f\n", root->weight);
-            for (int i=0; i < tabs; i++) {
-                printf("  ");
-            }
-            printf("Left:\n");
-            printHuffTree(root->left, tabs+1);
-            for (int i=0; i < tabs; i++) {
-                printf("  ");
+/*
+ *  Byte histograms
+ *
+ *  Counting into one table stalls whenever neighbouring bytes are equal, since each
+ *  increment has to wait for the store before it. Spreading bytes over four tables
+ *  keeps those chains apart. The 32 bit sub-counts are folded into the totals
+ *  before they could overflow.
+ */
+#define HIST_CHUNK ((size_t) 1 << 30)
+// Below this it isn't worth waking up threads
+#define HIST_MIN_PARALLEL (1 << 20)
+#define HIST_READ_SIZE (1 << 24)
+
+void histogram(const u8* in, size_t n, uint64_t* counts) {
+    uint32_t tables[4][256];
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    while (n > 0) {
+        size_t len = n < HIST_CHUNK ? n : HIST_CHUNK;
+        memset(tables, 0, sizeof(tables));
+        size_t i = 0;
+        // Unrolled so consecutive bytes land in different tables
+        for (; i + 16 <= len; i += 16) {
+            for (int k=0; k < 16; k += 4) {
+                tables[0][in[i + k]]++;
+                tables[1][in[i + k + 1]]++;
+                tables[2][in[i + k + 2]]++;
+                tables[3][in[i + k + 3]]++;
             }
-            printf("Right:\n");
-            printHuffTree(root->right, tabs+1);
-            printf("\n");
         }
+        for (; i < len; i++) {
+            tables[0][in[i]]++;
+        }
+        for (int c=0; c < 256; c++) {
+            counts[c] += (uint64_t) tables[0][c] + tables[1][c] + tables[2][c] + tables[3][c];
+        }
+        in += len;
+        n -= len;
     }
 }
 
 
-
-void huffmanEncodeWithTable(FILE* infp, FILE* outfp, HuffTable* table) {
-
-    // Write huffman table
-    writeInt32(outfp, table->nSym);
-    writeInt32(outfp, table->entrySize);
-    for (int i=0; i < table->nSym; i++) {
-        writeInt32(outfp, table->codeLens[i]);
-    }
-    for (int i=0; i < table->nSym * table->entrySize; i++) {
-        putc((char) table->codes[i], outfp);
-    }
+typedef struct HistJob {
+    const u8* in;
+    size_t n;
+    size_t chunk;
+    uint64_t (*counts)[256];
+} HistJob;
 
 
-    BitFile outbfp;
-    bfFromFilePtr(&outbfp, outfp);
-    int c;
-    while ((c = getc(infp)) != EOF) {
-        int len = table->codeLens[c];    
-        u8* code = table->codes + c * table->entrySize;
-        for (int i=0; i < len; i++) {
-            u8 nextBit = getIthBit(code, i);
-            bfWrite((char) nextBit, &outbfp);
-        }
-    }
-    if (outbfp.count != 0) {
-        // Bits needed to complete the byte
-        int needLen = 8 - outbfp.count;
-        // Find code with prefix that would fill byte
-        for (int c=0; c < table->nSym; c++) {
-            int len = table->codeLens[c];    
-            if (len > needLen) {
-                u8* code = table->codes + c * table->entrySize;
-                int i = 0;
-                while (outbfp.count != 0) {
-                    bfWrite((char) getIthBit(code, i), &outbfp);
-                    i++;
-                }
-                break;
-            }
-        }
-    }
+static void histJob(void* ctx, int job) {
+    HistJob* h = (HistJob*) ctx;
+    size_t start = job * h->chunk;
+    size_t len = h->n - start < h->chunk ? h->n - start : h->chunk;
+    histogram(h->in + start, len, h->counts[job]);
 }
 
 
-void huffmanDecode(FILE* infp, FILE* outfp, HuffNode *tree) {
-
-    BitFile inbfp; 
-    bfFromFilePtr(&inbfp, infp);
-
-    HuffNode* curr = tree;
-    int c;
-    while ((c = bfRead(&inbfp)) != EOF) {
-        if (!c) {
-            curr = curr->left;
-        } else {
-            curr = curr->right;
-        }
-
-        if (!curr->left) {
-            ASSERT(!curr->right, "Huffman tree malformed in huffmanDecode. All nodes must have 0 or 2 children\n");
-            fputc((char) curr->sym, outfp);
-            curr = tree;
+// Histogram split over the thread pool, each thread counts a slice then they are summed
+void histogramParallel(const u8* in, size_t n, uint64_t* counts) {
+    int nJobs = numThreads();
+    if (n < HIST_MIN_PARALLEL || nJobs == 1) {
+        histogram(in, n, counts);
+        return;
+    }
+    HistJob h;
+    h.in = in;
+    h.n = n;
+    h.chunk = (n + nJobs - 1) / nJobs;
+    nJobs = (int) ((n + h.chunk - 1) / h.chunk);
+    h.counts = (uint64_t (*)[256]) malloc(nJobs * sizeof(*h.counts));
+    ASSERT(h.counts, "Error: Out of memory in histogramParallel.\n");
+    parallelFor(nJobs, histJob, &h);
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    for (int j=0; j < nJobs; j++) {
+        for (int c=0; c < 256; c++) {
+            counts[c] += h.counts[j][c];
         }
     }
+    free(h.counts);
 }
-*/
+
 
 typedef struct HuffNode {
     union {
@@ -337,34 +639,42 @@ typedef struct HuffNode {
 
 typedef struct HuffTree {
     HuffNode nodes[NUM_HUFF_NODES];
-    float weights[NUM_HUFF_NODES];
+    uint64_t weights[NUM_HUFF_NODES];
 } HuffTree;
 
 
 typedef struct HuffTable {
-    int codeLens[NUM_HUFF_SYMS];
-    // Shouldn't be possible to have a proper tree with more than num syms bits for a
-    // particular symbol
-    u8 codes[NUM_HUFF_SYMS * NUM_HUFF_SYMS];
+    u8 codeLens[NUM_HUFF_SYMS];
+    // Canonical codes, right aligned. Limiting the length keeps them in an int.
+    uint32_t codes[NUM_HUFF_SYMS];
 } HuffTable;
 
 
 
-void buildHuffTree(HuffTree* tree, int *syms, float* symWeights) {
-    int nOrphans = NUM_HUFF_SYMS;
+void buildHuffTree(HuffTree* tree, int *syms, uint64_t* symWeights) {
+    int nOrphans = 0;
     int orphans[NUM_HUFF_SYMS];
     HuffNode* nodes = tree->nodes;
-    float* weights = tree->weights;
-    // Initialize leaf nodes
+    uint64_t* weights = tree->weights;
+    memset(nodes, 0, sizeof(tree->nodes));
+    // Initialize leaf nodes, only symbols that show up become orphans
     for (int i=0; i < NUM_HUFF_SYMS; i++) {
-        orphans[i] = NUM_HUFF_SYMS+i-1;
         nodes[NUM_HUFF_SYMS + i - 1].sym = syms[i];
         nodes[NUM_HUFF_SYMS + i - 1].isParent = 0;
         weights[NUM_HUFF_SYMS + i - 1] = symWeights[i];
+        if (symWeights[i] > 0) {
+            orphans[nOrphans++] = NUM_HUFF_SYMS+i-1;
+        }
+    }
+    // Root has to be a parent so pad with unused symbols
+    for (int i=0; nOrphans < 2; i++) {
+        if (symWeights[i] == 0) {
+            orphans[nOrphans++] = NUM_HUFF_SYMS+i-1;
+        }
     }
 
-    // Build parent nodes
-    for (int i=NUM_HUFF_SYMS-2; i >= 0; i--) {
+    // Build parent nodes, root ends up at 0
+    for (int i=nOrphans-2; i >= 0; i--) {
         int small1, small2;
         small1 = orphans[0];
         small2 = orphans[1];
@@ -400,49 +710,154 @@ void buildHuffTree(HuffTree* tree, int *syms, float* symWeights) {
 }
 
 
-void extractHuffCodes(HuffTable* res, HuffTree* tree) {
+/*
+ *  Length limited code lengths by package-merge
+ *
+ *  Level maxLen holds the symbols sorted by weight. Every level above holds the
+ *  symbols merged with the pairs ("packages") of the level below. Taking the
+ *  2n - 2 lightest items of the top level and expanding the packages back down, a
+ *  symbol's code length is the number of levels it was taken from.
+ */
+void packageMerge(u8* codeLens, int* syms, uint64_t* symWeights, int n, int maxLen) {
+    ASSERT(n <= (1 << maxLen), "Error in packageMerge: Too many symbols for the maximum code length.\n");
+    // Sort symbols lightest first
+    for (int i=1; i < n; i++) {
+        int sym = syms[i];
+        int j = i;
+        while (j > 0 && symWeights[syms[j-1]] > symWeights[sym]) {
+            syms[j] = syms[j-1];
+            j--;
+        }
+        syms[j] = sym;
+    }
+
+    int listSize = 2 * n;
+    uint64_t* weights = (uint64_t*) malloc(maxLen * listSize * sizeof(uint64_t));
+    u8* isLeaf = (u8*) malloc(maxLen * listSize);
+    int* lens = (int*) malloc(maxLen * sizeof(int));
+    ASSERT(weights && isLeaf && lens, "Error: Out of memory in packageMerge.\n");
+
+    // Row maxLen-1 is the deepest level
+    for (int level=maxLen-1; level >= 0; level--) {
+        uint64_t* w = weights + level * listSize;
+        u8* leaf = isLeaf + level * listSize;
+        uint64_t* below = weights + (level + 1) * listSize;
+        int nPackages = level == maxLen-1 ? 0 : lens[level + 1] / 2;
+        int i = 0;
+        int p = 0;
+        int k = 0;
+        while (i < n || p < nPackages) {
+            uint64_t pw = p < nPackages ? below[2*p] + below[2*p + 1] : 0;
+            if (p >= nPackages || (i < n && symWeights[syms[i]] <= pw)) {
+                w[k] = symWeights[syms[i++]];
+                leaf[k++] = 1;
+            } else {
+                w[k] = pw;
+                leaf[k++] = 0;
+                p++;
+            }
+        }
+        lens[level] = k;
+    }
+
+    for (int i=0; i < n; i++) {
+        codeLens[syms[i]] = 0;
+    }
+    int take = 2 * n - 2;
+    for (int level=0; level < maxLen && take > 0; level++) {
+        u8* leaf = isLeaf + level * listSize;
+        int nLeaves = 0;
+        for (int k=0; k < take; k++) {
+            nLeaves += leaf[k];
+        }
+        // Chosen leaves are always the lightest ones
+        for (int i=0; i < nLeaves; i++) {
+            codeLens[syms[i]]++;
+        }
+        take = 2 * (take - nLeaves);
+    }
+
+    free(weights);
+    free(isLeaf);
+    free(lens);
+}
+
+
+// Assign canonical codes: shorter codes first, then in symbol order
+void assignCanonicalCodes(HuffTable* table) {
+    int lenCounts[HUFF_MAX_CODE_LEN + 1] = {0};
+    uint32_t nextCode[HUFF_MAX_CODE_LEN + 1];
+    for (int i=0; i < NUM_HUFF_SYMS; i++) {
+        ASSERT(table->codeLens[i] <= HUFF_MAX_CODE_LEN, "Error: Huffman code length over the maximum.\n");
+        lenCounts[table->codeLens[i]]++;
+    }
+    lenCounts[0] = 0;
+    uint32_t code = 0;
+    for (int len=1; len <= HUFF_MAX_CODE_LEN; len++) {
+        code = (code + lenCounts[len-1]) << 1;
+        nextCode[len] = code;
+    }
+    for (int i=0; i < NUM_HUFF_SYMS; i++) {
+        int len = table->codeLens[i];
+        table->codes[i] = len ? nextCode[len]++ : 0;
+    }
+}
+
+
+void extractHuffCodes(HuffTable* res, HuffTree* tree, int maxLen) {
+    ASSERT(maxLen >= 8 && maxLen <= HUFF_MAX_CODE_LEN, "Error in extractHuffCodes: Maximum code length must be between 8 and HUFF_MAX_CODE_LEN.\n");
     int lengths[NUM_HUFF_NODES];
-    lengths[0] = 0;
-    int maxLen = 0;
     for (int i=0; i < NUM_HUFF_NODES; i++) {
+        lengths[i] = -1;
+    }
+    lengths[0] = 0;
+    int longest = 0;
+    // Parents always come before their children
+    for (int i=0; i < NUM_HUFF_SYMS - 1; i++) {
         HuffNode curr = tree->nodes[i];
-        if (curr.isParent) {
+        if (curr.isParent && lengths[i] >= 0) {
             lengths[curr.left] = lengths[i] + 1;
             lengths[curr.right] = lengths[i] + 1;
-            if (lengths[i] + 1 > maxLen) {
-                maxLen = lengths[i] + 1;
-            } 
-        } else {
-            res->codeLens[i-NUM_HUFF_SYMS+1] = lengths[i];
+            if (lengths[i] + 1 > longest) {
+                longest = lengths[i] + 1;
+            }
         }
     }
-    ASSERT(((maxLen+7)/8) < NUM_HUFF_SYMS, "Error: Code was written expecting maximum code length (in bytes) to be less than the total number of symbols.\n");
-
-    u8 tempCodes[NUM_HUFF_NODES * NUM_HUFF_SYMS];
 
-    for (int i=0; i < NUM_HUFF_NODES; i++) {
-        HuffNode curr = tree->nodes[i];
-        int byt;
-        // Copy this code to it's children
-        for (byt=0; byt < (lengths[i]+7) / 8; byt++) {
-            tempCodes[curr.left*NUM_HUFF_SYMS + byt] = tempCodes[i*NUM_HUFF_SYMS+byt];
-            tempCodes[curr.right*NUM_HUFF_SYMS + byt] = tempCodes[i*NUM_HUFF_SYMS+byt];
+    int syms[NUM_HUFF_SYMS];
+    uint64_t weights[NUM_HUFF_SYMS];
+    int n = 0;
+    for (int i=0; i < NUM_HUFF_SYMS; i++) {
+        int leaf = NUM_HUFF_SYMS + i - 1;
+        int sym = tree->nodes[leaf].sym;
+        res->codeLens[sym] = lengths[leaf] > 0 ? lengths[leaf] : 0;
+        weights[sym] = tree->weights[leaf];
+        if (lengths[leaf] > 0) {
+            syms[n++] = sym;
         }
-
-        // Current bit to set is 1 after this code's length
-        int bitIdx = lengths[i];
-        // Left is set off at that bit
-        tempCodes[curr.left*NUM_HUFF_SYMS + (bitIdx / 8)] &= ((u8) ~(0x80 >> (bitIdx%8)));
-        // Right is set on at that bit
-        tempCodes[curr.right*NUM_HUFF_SYMS + (bitIdx / 8)] |= ((u8) (0x80 >> (bitIdx%8)));
     }
+    if (longest > maxLen) {
+        packageMerge(res->codeLens, syms, weights, n, maxLen);
+    }
+    assignCanonicalCodes(res);
+}
 
-    for (int i=0; i < NUM_HUFF_SYMS * NUM_HUFF_SYMS; i++) {
-        // Copy over codes for the leaf nodes
-        res->codes[i] = tempCodes[i + (NUM_HUFF_SYMS-1) * NUM_HUFF_SYMS];
+
+// Code lengths fit in 4 bits so the table is stored in NUM_HUFF_SYMS / 2 bytes
+#define HUFF_HEADER_SIZE (NUM_HUFF_SYMS / 2)
+
+void packCodeLens(const u8* codeLens, u8* out) {
+    for (int i=0; i < NUM_HUFF_SYMS; i += 2) {
+        out[i/2] = (u8) ((codeLens[i] << 4) | codeLens[i+1]);
     }
+}
 
 
+void unpackCodeLens(const u8* in, u8* codeLens) {
+    for (int i=0; i < NUM_HUFF_SYMS; i += 2) {
+        codeLens[i] = in[i/2] >> 4;
+        codeLens[i+1] = in[i/2] & 0x0f;
+    }
 }
 
 
@@ -452,9 +867,8 @@ void printHuffTable(HuffTable *table) {
         int length = table->codeLens[i];
         printf("  Len: %d\n", length);
         printf("  Code: ");
-        for (int j=0; j < length; j++) {
-            int bit = table->codes[i*NUM_HUFF_SYMS + (j/8)] & (0x80 >> j % 8);
-            printf("%d", bit != 0);
+        for (int j=length-1; j >= 0; j--) {
+            printf("%d", (table->codes[i] >> j) & 1);
         }
         printf("\n");
         
@@ -462,154 +876,3338 @@ void printHuffTable(HuffTable *table) {
 }
 
 
-void huffmanEncodeWithTree(FILE* infp, FILE* outfp, HuffTree* tree) {
+void huffmanEncodeWithTree(FILE* infp, FILE* outfp, HuffTree* tree, uint64_t nBytes) {
     HuffTable table;
-    extractHuffCodes(&table, tree);
-
-    BitFile outbfp;
-    bfFromFilePtr(&outbfp, outfp);
-
-    int c;
-    while ((c = getc(infp)) != EOF) {
-        int len = table.codeLens[c];    
-        u8* code = table.codes + c * NUM_HUFF_SYMS;
-        for (int i=0; i < len; i++) {
-            u8 nextBit = getIthBit(code, i);
-            bfWrite((char) nextBit, &outbfp);
-        }
-    }
-    if (outbfp.count != 0) {
-        // Bits needed to complete the byte
-        int needLen = 8 - outbfp.count;
-        // Find code with prefix that would fill byte
-        for (int c=0; c < NUM_HUFF_SYMS; c++) {
-            int len = table.codeLens[c];    
-            if (len > needLen) {
-                u8* code = table.codes + c * NUM_HUFF_SYMS;
-                int i = 0;
-                while (outbfp.count != 0) {
-                    bfWrite((char) getIthBit(code, i), &outbfp);
-                    i++;
-                }
-                break;
-            }
+    extractHuffCodes(&table, tree, HUFF_MAX_CODE_LEN);
+
+    // Header is the byte count and the code lengths, which is all the decoder needs
+    u8 header[HUFF_HEADER_SIZE];
+    packCodeLens(table.codeLens, header);
+    writeInt64(outfp, nBytes);
+    fwrite(header, 1, HUFF_HEADER_SIZE, outfp);
+
+    BitStream outbs;
+    bsWriterFromFilePtr(&outbs, outfp);
+
+    ByteReader br;
+    brOpen(&br, infp);
+    const u8* in;
+    size_t n;
+    while ((n = brSpan(&br, &in)) > 0) {
+        for (size_t i=0; i < n; i++) {
+            int c = in[i];
+            bsPutBits(&outbs, table.codes[c], table.codeLens[c]);
         }
+        brSkip(&br, n);
     }
-    
+    brClose(&br);
+    bsWriteClose(&outbs);
 }
 
 
-void huffmanDecodeWithTree(FILE* infp, FILE* outfp, HuffTree* tree) {
-    BitFile inbfp; 
-    bfFromFilePtr(&inbfp, infp);
-
-    HuffNode* curr = tree->nodes;
-    int c;
-    while ((c = bfRead(&inbfp)) != EOF) {
-        if (!c) {
-            curr = &tree->nodes[curr->left];
-        } else {
-            curr = &tree->nodes[curr->right];
-        }
+/*
+ *  Table driven Huffman decoding
+ *
+ *  The root table is indexed by the next HUFF_LOOKUP_BITS bits of the input. An entry
+ *  either resolves whole symbols (two when both codes fit in the lookup bits) or links
+ *  to a sub-table for codes longer than the lookup bits, which is indexed by the bits
+ *  that follow.
+ */
+#define HUFF_LOOKUP_BITS 11
+
+typedef struct HuffDecEntry {
+    // Number of symbols resolved by this entry, 0 if it links to a sub-table
+    u8 nSyms;
+    // Bits consumed by all resolved symbols, or bits leading to the sub-table
+    u8 len;
+    // Bits consumed by the first symbol alone
+    u8 firstLen;
+    // Number of bits used to index the linked sub-table
+    u8 subBits;
+    union {
+        u8 syms[2];
+        // Index of the first entry of the linked sub-table
+        uint32_t sub;
+    };
+} HuffDecEntry;
 
-        if (!curr->isParent) {
-            fputc((char) curr->sym, outfp);
-            curr = tree->nodes;
-        }
-    }
-}
 
+typedef struct HuffDecTable {
+    // Root table followed by all sub-tables
+    HuffDecEntry entries[(1 << HUFF_LOOKUP_BITS) + NUM_HUFF_SYMS * (1 << (HUFF_MAX_CODE_LEN - HUFF_LOOKUP_BITS))];
+} HuffDecTable;
 
 
-void countCharFreqs(FILE* infp, float* weights) {
-    int c;
-    uint64_t counts[256];
-    uint64_t max;
-    for (int i=0; i < 256; i++) {
-        counts[i] = 0;
+void buildHuffDecTable(HuffDecTable* dt, const u8* codeLens) {
+    HuffTable table;
+    memcpy(table.codeLens, codeLens, NUM_HUFF_SYMS);
+    assignCanonicalCodes(&table);
+
+    HuffDecEntry* root = dt->entries;
+    // Anything the codes don't cover decodes to a 0 length symbol
+    memset(root, 0, (1 << HUFF_LOOKUP_BITS) * sizeof(HuffDecEntry));
+    for (int i=0; i < (1 << HUFF_LOOKUP_BITS); i++) {
+        root[i].nSyms = 1;
     }
-    while ((c = fgetc(infp)) != EOF) {
-        counts[c] += 1;
+
+    // Sub-tables are sized for the longest code sharing their prefix
+    u8 subBits[1 << HUFF_LOOKUP_BITS] = {0};
+    for (int c=0; c < NUM_HUFF_SYMS; c++) {
+        int len = table.codeLens[c];
+        if (len > HUFF_LOOKUP_BITS) {
+            int prefix = table.codes[c] >> (len - HUFF_LOOKUP_BITS);
+            if (len - HUFF_LOOKUP_BITS > subBits[prefix]) {
+                subBits[prefix] = len - HUFF_LOOKUP_BITS;
+            }
+        }
     }
-    max = counts[0];
-    for (int i=1; i < 256; i++) {
-        if (counts[i] > max) {
-            max = counts[i];
+    uint32_t nEntries = 1 << HUFF_LOOKUP_BITS;
+    for (int prefix=0; prefix < (1 << HUFF_LOOKUP_BITS); prefix++) {
+        if (subBits[prefix]) {
+            root[prefix].nSyms = 0;
+            root[prefix].len = HUFF_LOOKUP_BITS;
+            root[prefix].firstLen = HUFF_LOOKUP_BITS;
+            root[prefix].subBits = subBits[prefix];
+            root[prefix].sub = nEntries;
+            nEntries += 1 << subBits[prefix];
         }
     }
-    for (int i=0; i < 256; i++) {
-        weights[i] = counts[i] / (float) max;
+
+    for (int c=0; c < NUM_HUFF_SYMS; c++) {
+        int len = table.codeLens[c];
+        if (len == 0) {
+            continue;
+        }
+        HuffDecEntry* e;
+        int fill;
+        if (len <= HUFF_LOOKUP_BITS) {
+            fill = HUFF_LOOKUP_BITS - len;
+            e = root + (table.codes[c] << fill);
+        } else {
+            HuffDecEntry* link = root + (table.codes[c] >> (len - HUFF_LOOKUP_BITS));
+            int rest = len - HUFF_LOOKUP_BITS;
+            fill = link->subBits - rest;
+            e = dt->entries + link->sub + ((table.codes[c] & ((1u << rest) - 1)) << fill);
+            len = rest;
+        }
+        for (int i=0; i < (1 << fill); i++) {
+            e[i].nSyms = 1;
+            e[i].len = len;
+            e[i].firstLen = len;
+            e[i].subBits = 0;
+            e[i].syms[0] = (u8) c;
+        }
     }
 
-    // Reset to start
-    fseek(infp, 0, SEEK_SET);
+    // Pair up root entries whose leftover bits hold another whole code
+    for (int i=0; i < (1 << HUFF_LOOKUP_BITS); i++) {
+        HuffDecEntry* e = root + i;
+        if (e->nSyms == 1 && e->len > 0) {
+            HuffDecEntry* next = root + ((i << e->len) & ((1 << HUFF_LOOKUP_BITS) - 1));
+            if (next->nSyms != 0 && next->firstLen > 0 && e->len + next->firstLen <= HUFF_LOOKUP_BITS) {
+                e->nSyms = 2;
+                e->syms[1] = next->syms[0];
+                e->len += next->firstLen;
+            }
+        }
+    }
 }
 
 
-void moveToFrontTransform(FILE* infp, FILE* outfp) {
-    // Position that each character maps to
-    int dict[256];
-    rangeArr(256, dict);
+// Decode one symbol, the longest code must already be buffered
+static inline u8 huffDecodeOne(const HuffDecTable* dt, BitStream* bs) {
+    const HuffDecEntry* e = &dt->entries[bsPeekBits(bs, HUFF_LOOKUP_BITS)];
+    if (e->nSyms == 0) {
+        bsSkipBits(bs, HUFF_LOOKUP_BITS);
+        e = &dt->entries[e->sub + bsPeekBits(bs, e->subBits)];
+    }
+    bsSkipBits(bs, e->firstLen);
+    return e->syms[0];
+}
 
-    int c;
-    while ((c = fgetc(infp)) != EOF) {
-        int idx = 0;
-        int last;
-        for (idx=0; dict[idx] != c; idx++) {
-            int temp;
-            temp = last;
-            last = dict[idx];
-            dict[idx] = temp;
-        }
-        dict[idx] = last;
-        dict[0] = c;
 
-        fputc((char) idx, outfp);
+// Decode exactly n symbols into out
+void huffDecodeBuf(const HuffDecTable* dt, BitStream* bs, u8* out, size_t n) {
+    size_t pos = 0;
+    // Each lookup takes at most HUFF_MAX_CODE_LEN bits and gives at most 2 symbols,
+    // so 3 lookups fit in one refill
+    while (pos + 6 <= n) {
+        bsRefill(bs);
+        for (int k=0; k < 3; k++) {
+            const HuffDecEntry* e = &dt->entries[bsPeekBits(bs, HUFF_LOOKUP_BITS)];
+            if (e->nSyms == 0) {
+                bsSkipBits(bs, HUFF_LOOKUP_BITS);
+                e = &dt->entries[e->sub + bsPeekBits(bs, e->subBits)];
+            }
+            out[pos] = e->syms[0];
+            out[pos + 1] = e->syms[1];
+            pos += e->nSyms;
+            bsSkipBits(bs, e->len);
+        }
+    }
+    while (pos < n) {
+        bsRefill(bs);
+        out[pos++] = huffDecodeOne(dt, bs);
     }
 }
 
 
-void invMoveToFrontTransform(FILE* infp, FILE* outfp) {
-    int dict[256];
-    rangeArr(256, dict);
-
-    int idx;
-    while ((idx = fgetc(infp)) != EOF) {
-        int c = dict[idx];
-        fputc((char) c, outfp);
 
-        int last;
-        for (int i=0; i < idx; i++) {
-            int temp = last;
-            last = dict[i];
-            dict[i] = temp;
-        }
-        dict[idx] = last;
-        dict[0] = c;
-    }
-};
+// Bytes of zero padding decoders want after in-memory input so refills never check
+#define HUFF_SLACK 16
 
+// Worst case size of n bytes of Huffman codes
+#define HUFF_BOUND(n) ((n) / 8 * HUFF_MAX_CODE_LEN + HUFF_MAX_CODE_LEN + 8)
 
-void imgQuantTransform(FILE* infp, FILE* outfp) {
-    BMPFileHeader h;
-    readBMPHeader(infp, &h);
-    copyBMPHeader(infp, outfp, &h);
 
-    int fac = IMG_QUANT_FAC;
-    
-    int c;
-    for (int i=0; i < h.height * h.width * (h.bitsPerPixel/8); i++) {
-        c = fgetc(infp);
-        ASSERT(c != EOF, "Error in imgQuantTransform: Unexpected end of file!\n");
-        if ( c > 256-fac || c % fac < fac / 2) {
-            c = c / fac;
-        } else {
-            c = c / fac + 1;
-        }
-        fputc((char) c, outfp);
-    }
+// Build a Huffman table for the bytes in a buffer
+void huffTableFromBuf(HuffTable* table, const u8* in, size_t n) {
+    uint64_t counts[NUM_HUFF_SYMS];
+    histogram(in, n, counts);
+    int syms[NUM_HUFF_SYMS];
+    rangeArr(NUM_HUFF_SYMS, syms);
 
-    copyRemaining(infp, outfp);
+    HuffTree tree;
+    buildHuffTree(&tree, syms, counts);
+    extractHuffCodes(table, &tree, HUFF_MAX_CODE_LEN);
+}
+
+
+// Refill from memory without bounds checks, needs 8 readable bytes at pos
+static inline void bsRefillFast(BitStream* bs) {
+    bs->acc |= readBE64(bs->buf + bs->pos) >> bs->nBits;
+    bs->pos += (63 - bs->nBits) >> 3;
+    bs->nBits |= 56;
+}
+
+
+// Encode n bytes into out as one stream. Returns the number of bytes written.
+size_t huffEncodeBuf(const HuffTable* table, const u8* in, size_t n, u8* out, size_t cap) {
+    BitStream bs;
+    bsWriterFromBuffer(&bs, out, cap);
+    for (size_t i=0; i < n; i++) {
+        bsPutBits(&bs, table->codes[in[i]], table->codeLens[in[i]]);
+    }
+    return bsFlush(&bs);
+}
+
+
+// Decode one table lookup (1 or 2 symbols) to out, returns the new end of out
+static inline u8* huffDecodeStep(const HuffDecTable* dt, BitStream* bs, u8* out) {
+    const HuffDecEntry* e = &dt->entries[bsPeekBits(bs, HUFF_LOOKUP_BITS)];
+    if (e->nSyms == 0) {
+        bsSkipBits(bs, HUFF_LOOKUP_BITS);
+        e = &dt->entries[e->sub + bsPeekBits(bs, e->subBits)];
+    }
+    out[0] = e->syms[0];
+    out[1] = e->syms[1];
+    bsSkipBits(bs, e->len);
+    return out + e->nSyms;
+}
+
+
+/*
+ *  Interleaved Huffman streams
+ *
+ *  A single stream is latency bound since where a code starts depends on the length
+ *  of the one before it. Splitting the input into HUFF_NUM_STREAMS equal segments,
+ *  each coded as its own stream, gives the decoder independent dependency chains to
+ *  advance in lockstep.
+ *
+ *  Format: (HUFF_NUM_STREAMS - 1) 32 bit stream sizes (the jump table), then the
+ *  streams back to back. The last stream runs to the end.
+ */
+#define HUFF_NUM_STREAMS 4
+#define HUFF_JUMP_SIZE (4 * (HUFF_NUM_STREAMS - 1))
+
+
+size_t huffEncodeX4(const HuffTable* table, const u8* in, size_t n, u8* out, size_t cap) {
+    size_t seg = (n + HUFF_NUM_STREAMS - 1) / HUFF_NUM_STREAMS;
+    size_t pos = HUFF_JUMP_SIZE;
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        size_t start = s * seg < n ? s * seg : n;
+        size_t len = n - start < seg ? n - start : seg;
+        size_t size = huffEncodeBuf(table, in + start, len, out + pos, cap - pos);
+        if (s < HUFF_NUM_STREAMS - 1) {
+            ASSERT(size <= UINT32_MAX, "Error in huffEncodeX4: Stream too large for jump table.\n");
+            writeLE32(out + 4*s, (uint32_t) size);
+        }
+        pos += size;
+    }
+    return pos;
+}
+
+
+// 'in' needs HUFF_SLACK readable bytes past 'size'
+void huffDecodeX4(const HuffDecTable* dt, const u8* in, size_t size, u8* out, size_t n) {
+    ASSERT(size >= HUFF_JUMP_SIZE, "Error in huffDecodeX4: Missing jump table.\n");
+    size_t seg = (n + HUFF_NUM_STREAMS - 1) / HUFF_NUM_STREAMS;
+    BitStream bs[HUFF_NUM_STREAMS];
+    u8* outs[HUFF_NUM_STREAMS];
+    u8* ends[HUFF_NUM_STREAMS];
+    size_t pos = HUFF_JUMP_SIZE;
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        size_t streamSize = size - pos;
+        if (s < HUFF_NUM_STREAMS - 1) {
+            streamSize = readLE32(in + 4*s);
+        }
+        ASSERT(pos + streamSize <= size, "Error in huffDecodeX4: Corrupt jump table.\n");
+        bsReaderFromBuffer(&bs[s], in + pos, streamSize);
+        pos += streamSize;
+        size_t start = s * seg < n ? s * seg : n;
+        outs[s] = out + start;
+        ends[s] = out + (start + seg < n ? start + seg : n);
+    }
+
+    // Streams read into their neighbours' bytes at the end but those bits are never used
+    BitStream bs0 = bs[0], bs1 = bs[1], bs2 = bs[2], bs3 = bs[3];
+    u8 *o0 = outs[0], *o1 = outs[1], *o2 = outs[2], *o3 = outs[3];
+    // 3 lookups per refill giving at most 2 symbols each
+    while (o0 + 6 <= ends[0] && o1 + 6 <= ends[1] && o2 + 6 <= ends[2] && o3 + 6 <= ends[3]) {
+        bsRefillFast(&bs0);
+        bsRefillFast(&bs1);
+        bsRefillFast(&bs2);
+        bsRefillFast(&bs3);
+        for (int k=0; k < 3; k++) {
+            o0 = huffDecodeStep(dt, &bs0, o0);
+            o1 = huffDecodeStep(dt, &bs1, o1);
+            o2 = huffDecodeStep(dt, &bs2, o2);
+            o3 = huffDecodeStep(dt, &bs3, o3);
+        }
+    }
+    bs[0] = bs0; bs[1] = bs1; bs[2] = bs2; bs[3] = bs3;
+    outs[0] = o0; outs[1] = o1; outs[2] = o2; outs[3] = o3;
+
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        while (outs[s] < ends[s]) {
+            bsRefillFast(&bs[s]);
+            *outs[s]++ = huffDecodeOne(dt, &bs[s]);
+        }
+    }
+}
+
+
+
+// Count every byte in the file, then go back to the start. Returns the total.
+uint64_t countCharFreqs(FILE* infp, uint64_t* counts) {
+    size_t size;
+    const u8* span = fileSpan(infp, &size);
+    long at = span ? ftell(infp) : -1;
+    if (at >= 0 && (size_t) at <= size) {
+        // Count the file's span where it is, no reading
+        uint64_t part[256];
+        memset(counts, 0, 256 * sizeof(uint64_t));
+        for (size_t i=at; i < size; i += HIST_READ_SIZE) {
+            histogramParallel(span + i, size - i < HIST_READ_SIZE ? size - i : HIST_READ_SIZE, part);
+            for (int c=0; c < 256; c++) {
+                counts[c] += part[c];
+            }
+        }
+        fseek(infp, 0, SEEK_SET);
+        return size - at;
+    }
+
+    u8* buf = (u8*) malloc(HIST_READ_SIZE);
+    ASSERT(buf, "Error: Out of memory in countCharFreqs.\n");
+    uint64_t part[256];
+    uint64_t total = 0;
+    memset(counts, 0, 256 * sizeof(uint64_t));
+    size_t n;
+    while ((n = fread(buf, 1, HIST_READ_SIZE, infp)) > 0) {
+        histogramParallel(buf, n, part);
+        for (int i=0; i < 256; i++) {
+            counts[i] += part[i];
+        }
+        total += n;
+    }
+    free(buf);
+
+    // Reset to start
+    fseek(infp, 0, SEEK_SET);
+    return total;
+}
+
+
+/*
+ *  Huffman coding with canonical, length limited codes
+ *
+ *  Format: byte count (64 bit), packed code lengths, then the codes. The decoder
+ *  rebuilds everything it needs from the code lengths.
+ *
+ *  NOTE: Two passes over the input, does not work with stdin
+ */
+void huffmanCompress(FILE* infp, FILE* outfp) {
+    uint64_t counts[NUM_HUFF_SYMS];
+    int syms[NUM_HUFF_SYMS];
+    rangeArr(NUM_HUFF_SYMS, syms);
+    uint64_t nBytes = countCharFreqs(infp, counts);
+
+    HuffTree tree;
+    buildHuffTree(&tree, syms, counts);
+    huffmanEncodeWithTree(infp, outfp, &tree, nBytes);
+}
+
+
+void huffmanDecompress(FILE* infp, FILE* outfp) {
+    uint64_t nBytes = readInt64(infp);
+    u8 header[HUFF_HEADER_SIZE];
+    ASSERT(fread(header, 1, HUFF_HEADER_SIZE, infp) == HUFF_HEADER_SIZE, "Error in huffmanDecompress: Unexpected end of file in header.\n");
+    u8 codeLens[NUM_HUFF_SYMS];
+    unpackCodeLens(header, codeLens);
+
+    HuffDecTable* dt = (HuffDecTable*) malloc(sizeof(HuffDecTable));
+    ASSERT(dt, "Error: Out of memory in huffmanDecompress.\n");
+    buildHuffDecTable(dt, codeLens);
+
+    BitStream inbs;
+    bsReaderFromFilePtr(&inbs, infp);
+    u8* outBuf = (u8*) malloc(BS_BUF_SIZE);
+    ASSERT(outBuf, "Error: Out of memory in huffmanDecompress.\n");
+    while (nBytes > 0) {
+        size_t n = nBytes < BS_BUF_SIZE ? nBytes : BS_BUF_SIZE;
+        huffDecodeBuf(dt, &inbs, outBuf, n);
+        fwrite(outBuf, 1, n, outfp);
+        nBytes -= n;
+    }
+    free(outBuf);
+    bsReadClose(&inbs);
+    free(dt);
+}
+
+
+/*
+ *  Huffman coding with the input split over HUFF_NUM_STREAMS interleaved streams
+ *
+ *  Format: byte count (64 bit), packed code lengths, then the interleaved streams.
+ *  Works on the whole input in memory.
+ */
+void huffmanX4Compress(FILE* infp, FILE* outfp) {
+    size_t n;
+    u8* in = readAll(infp, &n, 0);
+
+    HuffTable table;
+    huffTableFromBuf(&table, in, n);
+
+    size_t cap = HUFF_JUMP_SIZE + HUFF_NUM_STREAMS * HUFF_BOUND(n / HUFF_NUM_STREAMS + 1);
+    u8* out = (u8*) malloc(cap);
+    ASSERT(out, "Error: Out of memory in huffmanX4Compress.\n");
+    size_t size = huffEncodeX4(&table, in, n, out, cap);
+
+    u8 header[HUFF_HEADER_SIZE];
+    packCodeLens(table.codeLens, header);
+    writeInt64(outfp, n);
+    fwrite(header, 1, HUFF_HEADER_SIZE, outfp);
+    fwrite(out, 1, size, outfp);
+
+    free(out);
+    free(in);
+}
+
+
+void huffmanX4Decompress(FILE* infp, FILE* outfp) {
+    uint64_t n = readInt64(infp);
+    u8 header[HUFF_HEADER_SIZE];
+    ASSERT(fread(header, 1, HUFF_HEADER_SIZE, infp) == HUFF_HEADER_SIZE, "Error in huffmanX4Decompress: Unexpected end of file in header.\n");
+    u8 codeLens[NUM_HUFF_SYMS];
+    unpackCodeLens(header, codeLens);
+
+    HuffDecTable* dt = (HuffDecTable*) malloc(sizeof(HuffDecTable));
+    ASSERT(dt, "Error: Out of memory in huffmanX4Decompress.\n");
+    buildHuffDecTable(dt, codeLens);
+
+    size_t size;
+    u8* in = readAll(infp, &size, HUFF_SLACK);
+    u8* out = (u8*) malloc(n + 2);
+    ASSERT(out, "Error: Out of memory in huffmanX4Decompress.\n");
+    huffDecodeX4(dt, in, size, out, n);
+    fwrite(out, 1, n, outfp);
+
+    free(out);
+    free(in);
+    free(dt);
+}
+
+
+/*
+ *  Block Huffman coding
+ *
+ *  Every HUFF_BLOCK_SIZE block gets its own code lengths followed by interleaved
+ *  streams, so the codes follow local statistics and blocks are counted, built and
+ *  coded in parallel (both ways).
+ */
+#define HUFF_BLOCK_SIZE (1 << 20)
+
+size_t huffBlockEncode(const u8* in, size_t n, u8* out, size_t cap) {
+    HuffTable table;
+    huffTableFromBuf(&table, in, n);
+    packCodeLens(table.codeLens, out);
+    return HUFF_HEADER_SIZE + huffEncodeX4(&table, in, n, out + HUFF_HEADER_SIZE, cap - HUFF_HEADER_SIZE);
+}
+
+
+void huffBlockDecode(const u8* in, size_t size, u8* out, size_t n) {
+    ASSERT(size >= HUFF_HEADER_SIZE, "Error in huffBlockDecode: Block too small for header.\n");
+    u8 codeLens[NUM_HUFF_SYMS];
+    unpackCodeLens(in, codeLens);
+    HuffDecTable* dt = (HuffDecTable*) malloc(sizeof(HuffDecTable));
+    ASSERT(dt, "Error: Out of memory in huffBlockDecode.\n");
+    buildHuffDecTable(dt, codeLens);
+    huffDecodeX4(dt, in + HUFF_HEADER_SIZE, size - HUFF_HEADER_SIZE, out, n);
+    free(dt);
+}
+
+
+const BlockCodec huffBlockCodec = {
+    huffBlockEncode,
+    huffBlockDecode,
+    HUFF_BLOCK_SIZE,
+    HUFF_HEADER_SIZE + HUFF_JUMP_SIZE + HUFF_NUM_STREAMS * HUFF_BOUND(HUFF_BLOCK_SIZE / HUFF_NUM_STREAMS + 1),
+    HUFF_SLACK
+};
+
+
+void huffmanBlockCompress(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &huffBlockCodec);
+}
+
+
+void huffmanBlockDecompress(FILE* infp, FILE* outfp) {
+    blockDecompress(infp, outfp, &huffBlockCodec);
+}
+
+
+/*
+ *  Order-1 context Huffman coding
+ *
+ *  Symbols are coded with a table picked by the byte before them. Keeping 256 tables
+ *  would cost too much header and cache, so contexts with similar statistics are
+ *  clustered into at most HUFF_O1_MAX_GROUPS groups that share a table. Codes are
+ *  limited to the lookup width so each group decodes with a single 2 byte per entry
+ *  table (symbol and length), 4 KiB per group.
+ *
+ *  Block format: group count, group of each context (256 bytes), packed code lengths
+ *  for each group, then HUFF_NUM_STREAMS interleaved streams as for order-0. Each
+ *  stream starts in context 0.
+ */
+#define HUFF_O1_BLOCK_SIZE (1 << 22)
+#define HUFF_O1_MAX_GROUPS 32
+#define HUFF_O1_MAX_CODE_LEN HUFF_LOOKUP_BITS
+#define HUFF_O1_CLUSTER_ITERS 4
+#define HUFF_O1_HEADER_MAX (1 + 256 + HUFF_O1_MAX_GROUPS * HUFF_HEADER_SIZE)
+
+typedef struct HuffO1Model {
+    int nGroups;
+    u8 ctxGroup[256];
+    HuffTable tables[HUFF_O1_MAX_GROUPS];
+} HuffO1Model;
+
+
+// Estimated bits to code every symbol seen in each context with each group's statistics
+static void groupCosts(uint32_t (*counts)[256], uint64_t (*groupCounts)[256], int nGroups, float (*costs)[HUFF_O1_MAX_GROUPS]) {
+    float bits[HUFF_O1_MAX_GROUPS][256];
+    for (int g=0; g < nGroups; g++) {
+        uint64_t total = 0;
+        for (int c=0; c < 256; c++) {
+            total += groupCounts[g][c];
+        }
+        // Half a count for unseen symbols so they are expensive but not impossible
+        float logTotal = log2f(total + 128.0f);
+        for (int c=0; c < 256; c++) {
+            bits[g][c] = logTotal - log2f(groupCounts[g][c] + 0.5f);
+        }
+    }
+    for (int ctx=0; ctx < 256; ctx++) {
+        for (int g=0; g < nGroups; g++) {
+            float cost = 0;
+            for (int c=0; c < 256; c++) {
+                cost += counts[ctx][c] * bits[g][c];
+            }
+            costs[ctx][g] = cost;
+        }
+    }
+}
+
+
+/*
+ *  k-means over contexts: seed the groups with the busiest contexts, then repeatedly
+ *  move each context to the group that codes it cheapest and rebuild the groups.
+ */
+void buildHuffO1Model(HuffO1Model* model, uint32_t (*counts)[256]) {
+    uint64_t ctxTotals[256];
+    int order[256];
+    int nActive = 0;
+    for (int ctx=0; ctx < 256; ctx++) {
+        ctxTotals[ctx] = 0;
+        for (int c=0; c < 256; c++) {
+            ctxTotals[ctx] += counts[ctx][c];
+        }
+        if (ctxTotals[ctx]) {
+            order[nActive++] = ctx;
+        }
+    }
+    // Busiest contexts first
+    for (int i=1; i < nActive; i++) {
+        int ctx = order[i];
+        int j = i;
+        while (j > 0 && ctxTotals[order[j-1]] < ctxTotals[ctx]) {
+            order[j] = order[j-1];
+            j--;
+        }
+        order[j] = ctx;
+    }
+
+    int nGroups = nActive < HUFF_O1_MAX_GROUPS ? nActive : HUFF_O1_MAX_GROUPS;
+    if (nGroups == 0) {
+        nGroups = 1;
+    }
+    uint64_t (*groupCounts)[256] = (uint64_t (*)[256]) calloc(HUFF_O1_MAX_GROUPS, sizeof(*groupCounts));
+    float (*costs)[HUFF_O1_MAX_GROUPS] = (float (*)[HUFF_O1_MAX_GROUPS]) malloc(256 * sizeof(*costs));
+    ASSERT(groupCounts && costs, "Error: Out of memory in buildHuffO1Model.\n");
+    memset(model->ctxGroup, 0, 256);
+    for (int g=0; g < nGroups && g < nActive; g++) {
+        for (int c=0; c < 256; c++) {
+            groupCounts[g][c] = counts[order[g]][c];
+        }
+    }
+
+    for (int iter=0; iter < HUFF_O1_CLUSTER_ITERS && nActive > nGroups; iter++) {
+        groupCosts(counts, groupCounts, nGroups, costs);
+        memset(groupCounts, 0, HUFF_O1_MAX_GROUPS * sizeof(*groupCounts));
+        for (int i=0; i < nActive; i++) {
+            int ctx = order[i];
+            int best = 0;
+            for (int g=1; g < nGroups; g++) {
+                if (costs[ctx][g] < costs[ctx][best]) {
+                    best = g;
+                }
+            }
+            model->ctxGroup[ctx] = (u8) best;
+            for (int c=0; c < 256; c++) {
+                groupCounts[best][c] += counts[ctx][c];
+            }
+        }
+    }
+    if (nActive <= nGroups) {
+        for (int g=0; g < nActive; g++) {
+            model->ctxGroup[order[g]] = (u8) g;
+        }
+    }
+
+    // Drop groups nothing was assigned to
+    int remap[HUFF_O1_MAX_GROUPS];
+    int nUsed = 0;
+    int syms[NUM_HUFF_SYMS];
+    rangeArr(NUM_HUFF_SYMS, syms);
+    for (int g=0; g < nGroups; g++) {
+        remap[g] = -1;
+        uint64_t total = 0;
+        for (int c=0; c < 256; c++) {
+            total += groupCounts[g][c];
+        }
+        if (total || (g == 0 && nUsed == 0 && nActive == 0)) {
+            HuffTree tree;
+            buildHuffTree(&tree, syms, groupCounts[g]);
+            extractHuffCodes(&model->tables[nUsed], &tree, HUFF_O1_MAX_CODE_LEN);
+            remap[g] = nUsed++;
+        }
+    }
+    for (int ctx=0; ctx < 256; ctx++) {
+        int g = remap[model->ctxGroup[ctx]];
+        model->ctxGroup[ctx] = (u8) (g < 0 ? 0 : g);
+    }
+    model->nGroups = nUsed;
+
+    free(costs);
+    free(groupCounts);
+}
+
+
+size_t huffO1EncodeStream(const HuffO1Model* model, const u8* in, size_t n, u8* out, size_t cap) {
+    BitStream bs;
+    bsWriterFromBuffer(&bs, out, cap);
+    const HuffTable* ctxTable[256];
+    for (int ctx=0; ctx < 256; ctx++) {
+        ctxTable[ctx] = &model->tables[model->ctxGroup[ctx]];
+    }
+    const HuffTable* table = ctxTable[0];
+    for (size_t i=0; i < n; i++) {
+        bsPutBits(&bs, table->codes[in[i]], table->codeLens[in[i]]);
+        table = ctxTable[in[i]];
+    }
+    return bsFlush(&bs);
+}
+
+
+size_t huffO1Encode(const u8* in, size_t n, u8* out, size_t cap) {
+    size_t seg = (n + HUFF_NUM_STREAMS - 1) / HUFF_NUM_STREAMS;
+    uint32_t (*counts)[256] = (uint32_t (*)[256]) calloc(256, sizeof(*counts));
+    ASSERT(counts, "Error: Out of memory in huffO1Encode.\n");
+    for (size_t i=0; i < n; i++) {
+        // Streams start in context 0
+        int ctx = i % seg == 0 ? 0 : in[i-1];
+        counts[ctx][in[i]]++;
+    }
+    HuffO1Model* model = (HuffO1Model*) malloc(sizeof(HuffO1Model));
+    ASSERT(model, "Error: Out of memory in huffO1Encode.\n");
+    buildHuffO1Model(model, counts);
+    free(counts);
+
+    size_t pos = 0;
+    out[pos++] = (u8) model->nGroups;
+    memcpy(out + pos, model->ctxGroup, 256);
+    pos += 256;
+    for (int g=0; g < model->nGroups; g++) {
+        packCodeLens(model->tables[g].codeLens, out + pos);
+        pos += HUFF_HEADER_SIZE;
+    }
+
+    u8* jump = out + pos;
+    pos += HUFF_JUMP_SIZE;
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        size_t start = s * seg < n ? s * seg : n;
+        size_t len = n - start < seg ? n - start : seg;
+        size_t size = huffO1EncodeStream(model, in + start, len, out + pos, cap - pos);
+        if (s < HUFF_NUM_STREAMS - 1) {
+            writeLE32(jump + 4*s, (uint32_t) size);
+        }
+        pos += size;
+    }
+    free(model);
+    return pos;
+}
+
+
+// Decode table entries are the symbol in the low byte and the code length above it
+static void buildHuffO1DecTable(uint16_t* dt, const u8* codeLens) {
+    HuffTable table;
+    memcpy(table.codeLens, codeLens, NUM_HUFF_SYMS);
+    assignCanonicalCodes(&table);
+    memset(dt, 0, (1 << HUFF_LOOKUP_BITS) * sizeof(uint16_t));
+    for (int c=0; c < NUM_HUFF_SYMS; c++) {
+        int len = table.codeLens[c];
+        ASSERT(len <= HUFF_LOOKUP_BITS, "Error: Order-1 code longer than the lookup bits.\n");
+        if (len == 0) {
+            continue;
+        }
+        int fill = HUFF_LOOKUP_BITS - len;
+        uint16_t* e = dt + (table.codes[c] << fill);
+        for (int i=0; i < (1 << fill); i++) {
+            e[i] = (uint16_t) (c | (len << 8));
+        }
+    }
+}
+
+
+static inline u8 huffO1DecodeOne(const uint16_t** ctxTable, BitStream* bs, u8 prev) {
+    uint16_t e = ctxTable[prev][bsPeekBits(bs, HUFF_LOOKUP_BITS)];
+    bsSkipBits(bs, e >> 8);
+    return (u8) e;
+}
+
+
+void huffO1Decode(const u8* in, size_t size, u8* out, size_t n) {
+    ASSERT(size >= 1 + 256, "Error in huffO1Decode: Block too small for header.\n");
+    int nGroups = in[0];
+    size_t pos = 1 + 256;
+    ASSERT(nGroups >= 1 && nGroups <= HUFF_O1_MAX_GROUPS && size >= pos + nGroups * HUFF_HEADER_SIZE + HUFF_JUMP_SIZE, "Error in huffO1Decode: Corrupt header.\n");
+    uint16_t (*tables)[1 << HUFF_LOOKUP_BITS] = (uint16_t (*)[1 << HUFF_LOOKUP_BITS]) malloc(nGroups * sizeof(*tables));
+    ASSERT(tables, "Error: Out of memory in huffO1Decode.\n");
+    for (int g=0; g < nGroups; g++) {
+        u8 codeLens[NUM_HUFF_SYMS];
+        unpackCodeLens(in + pos, codeLens);
+        buildHuffO1DecTable(tables[g], codeLens);
+        pos += HUFF_HEADER_SIZE;
+    }
+    const uint16_t* ctxTable[256];
+    for (int ctx=0; ctx < 256; ctx++) {
+        ASSERT(in[1 + ctx] < nGroups, "Error in huffO1Decode: Corrupt context groups.\n");
+        ctxTable[ctx] = tables[in[1 + ctx]];
+    }
+
+    const u8* jump = in + pos;
+    pos += HUFF_JUMP_SIZE;
+    size_t seg = (n + HUFF_NUM_STREAMS - 1) / HUFF_NUM_STREAMS;
+    BitStream bs[HUFF_NUM_STREAMS];
+    u8* outs[HUFF_NUM_STREAMS];
+    u8* ends[HUFF_NUM_STREAMS];
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        size_t streamSize = s < HUFF_NUM_STREAMS - 1 ? readLE32(jump + 4*s) : size - pos;
+        ASSERT(pos + streamSize <= size, "Error in huffO1Decode: Corrupt jump table.\n");
+        bsReaderFromBuffer(&bs[s], in + pos, streamSize);
+        pos += streamSize;
+        size_t start = s * seg < n ? s * seg : n;
+        outs[s] = out + start;
+        ends[s] = out + (start + seg < n ? start + seg : n);
+    }
+
+    BitStream bs0 = bs[0], bs1 = bs[1], bs2 = bs[2], bs3 = bs[3];
+    u8 *o0 = outs[0], *o1 = outs[1], *o2 = outs[2], *o3 = outs[3];
+    u8 p0 = 0, p1 = 0, p2 = 0, p3 = 0;
+    // 5 lookups of at most HUFF_LOOKUP_BITS fit in one refill
+    while (o0 + 5 <= ends[0] && o1 + 5 <= ends[1] && o2 + 5 <= ends[2] && o3 + 5 <= ends[3]) {
+        bsRefillFast(&bs0);
+        bsRefillFast(&bs1);
+        bsRefillFast(&bs2);
+        bsRefillFast(&bs3);
+        for (int k=0; k < 5; k++) {
+            *o0++ = p0 = huffO1DecodeOne(ctxTable, &bs0, p0);
+            *o1++ = p1 = huffO1DecodeOne(ctxTable, &bs1, p1);
+            *o2++ = p2 = huffO1DecodeOne(ctxTable, &bs2, p2);
+            *o3++ = p3 = huffO1DecodeOne(ctxTable, &bs3, p3);
+        }
+    }
+    bs[0] = bs0; bs[1] = bs1; bs[2] = bs2; bs[3] = bs3;
+    outs[0] = o0; outs[1] = o1; outs[2] = o2; outs[3] = o3;
+    u8 prevs[HUFF_NUM_STREAMS] = {p0, p1, p2, p3};
+
+    for (int s=0; s < HUFF_NUM_STREAMS; s++) {
+        while (outs[s] < ends[s]) {
+            bsRefillFast(&bs[s]);
+            *outs[s]++ = prevs[s] = huffO1DecodeOne(ctxTable, &bs[s], prevs[s]);
+        }
+    }
+    free(tables);
+}
+
+
+const BlockCodec huffO1BlockCodec = {
+    huffO1Encode,
+    huffO1Decode,
+    HUFF_O1_BLOCK_SIZE,
+    HUFF_O1_HEADER_MAX + HUFF_JUMP_SIZE + HUFF_NUM_STREAMS * HUFF_BOUND(HUFF_O1_BLOCK_SIZE / HUFF_NUM_STREAMS + 1),
+    HUFF_SLACK
+};
+
+
+void huffmanO1Compress(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &huffO1BlockCodec);
+}
+
+
+void huffmanO1Decompress(FILE* infp, FILE* outfp) {
+    blockDecompress(infp, outfp, &huffO1BlockCodec);
+}
+
+
+/*
+ *  tANS (table based asymmetric numeral systems) coding
+ *
+ *  Symbol counts are normalised to FSE_TABLE_SIZE and spread over a state table.
+ *  Each symbol moves the state and emits the low bits of the old state, so symbols
+ *  cost fractional bits unlike Huffman. Two states take turns on alternate symbols
+ *  so the decoder has two dependency chains to work on.
+ *
+ *  The encoder has to run backwards over the input. It records the bits it emits
+ *  and writes them out in reverse, so the decoder reads forward with a BitStream.
+ *
+ *  Block format: table log, normalised counts (varints), then the bits starting with
+ *  the two final encoder states.
+ */
+#define FSE_TABLE_LOG 11
+#define FSE_TABLE_SIZE (1 << FSE_TABLE_LOG)
+#define FSE_BLOCK_SIZE (1 << 20)
+#define FSE_HEADER_MAX (1 + 256 * 2)
+// At most FSE_TABLE_LOG bits per symbol plus the two states
+#define FSE_BOUND(n) (FSE_HEADER_MAX + ((n) + 2) / 8 * FSE_TABLE_LOG + FSE_TABLE_LOG + 8)
+
+typedef struct FseSymbolTransform {
+    int deltaFindState;
+    uint32_t deltaNbBits;
+} FseSymbolTransform;
+
+typedef struct FseEncTable {
+    uint16_t stateTable[FSE_TABLE_SIZE];
+    FseSymbolTransform symbolTT[256];
+} FseEncTable;
+
+typedef struct FseDecEntry {
+    uint16_t newState;
+    u8 sym;
+    u8 nbBits;
+} FseDecEntry;
+
+
+static inline int highBit32(uint32_t v) {
+    return 31 - __builtin_clz(v);
+}
+
+
+/*
+ *  Scale counts to sum to FSE_TABLE_SIZE, every symbol seen keeping at least 1.
+ *  Rounding leaves the sum off a little, which is fixed one step at a time wherever
+ *  it costs the fewest bits.
+ */
+void fseNormalizeCounts(const uint64_t* counts, uint64_t total, uint16_t* norm) {
+    int sum = 0;
+    for (int s=0; s < 256; s++) {
+        norm[s] = 0;
+        if (counts[s]) {
+            uint64_t scaled = (counts[s] * FSE_TABLE_SIZE + total / 2) / total;
+            norm[s] = (uint16_t) (scaled ? scaled : 1);
+        }
+        sum += norm[s];
+    }
+    while (sum != FSE_TABLE_SIZE) {
+        int best = -1;
+        double bestCost = 0;
+        for (int s=0; s < 256; s++) {
+            if (sum > FSE_TABLE_SIZE && norm[s] > 1) {
+                double cost = counts[s] * log2((double) norm[s] / (norm[s] - 1));
+                if (best < 0 || cost < bestCost) {
+                    best = s;
+                    bestCost = cost;
+                }
+            } else if (sum < FSE_TABLE_SIZE && norm[s] > 0) {
+                double cost = -(counts[s] * log2((double) (norm[s] + 1) / norm[s]));
+                if (best < 0 || cost < bestCost) {
+                    best = s;
+                    bestCost = cost;
+                }
+            }
+        }
+        ASSERT(best >= 0, "Error in fseNormalizeCounts: Can't normalise counts.\n");
+        if (sum > FSE_TABLE_SIZE) {
+            norm[best]--;
+            sum--;
+        } else {
+            norm[best]++;
+            sum++;
+        }
+    }
+}
+
+
+// Spread symbols over the table so each symbol's states are scattered evenly
+static void fseSpreadSymbols(const uint16_t* norm, u8* tableSymbol) {
+    int step = (FSE_TABLE_SIZE >> 1) + (FSE_TABLE_SIZE >> 3) + 3;
+    int pos = 0;
+    for (int s=0; s < 256; s++) {
+        for (int i=0; i < norm[s]; i++) {
+            tableSymbol[pos] = (u8) s;
+            pos = (pos + step) & (FSE_TABLE_SIZE - 1);
+        }
+    }
+}
+
+
+void buildFseEncTable(FseEncTable* et, const uint16_t* norm) {
+    u8 tableSymbol[FSE_TABLE_SIZE];
+    fseSpreadSymbols(norm, tableSymbol);
+    int cumul[257];
+    cumul[0] = 0;
+    for (int s=0; s < 256; s++) {
+        cumul[s+1] = cumul[s] + norm[s];
+    }
+    for (int u=0; u < FSE_TABLE_SIZE; u++) {
+        et->stateTable[cumul[tableSymbol[u]]++] = (uint16_t) (FSE_TABLE_SIZE + u);
+    }
+    int total = 0;
+    for (int s=0; s < 256; s++) {
+        if (norm[s] == 0) {
+            continue;
+        }
+        if (norm[s] == 1) {
+            et->symbolTT[s].deltaNbBits = (FSE_TABLE_LOG << 16) - FSE_TABLE_SIZE;
+            et->symbolTT[s].deltaFindState = total - 1;
+        } else {
+            int maxBitsOut = FSE_TABLE_LOG - highBit32(norm[s] - 1);
+            int minStatePlus = norm[s] << maxBitsOut;
+            et->symbolTT[s].deltaNbBits = (maxBitsOut << 16) - minStatePlus;
+            et->symbolTT[s].deltaFindState = total - norm[s];
+        }
+        total += norm[s];
+    }
+}
+
+
+void buildFseDecTable(FseDecEntry* dt, const uint16_t* norm) {
+    u8 tableSymbol[FSE_TABLE_SIZE];
+    fseSpreadSymbols(norm, tableSymbol);
+    uint32_t next[256];
+    for (int s=0; s < 256; s++) {
+        next[s] = norm[s];
+    }
+    for (int u=0; u < FSE_TABLE_SIZE; u++) {
+        u8 s = tableSymbol[u];
+        uint32_t x = next[s]++;
+        int nbBits = FSE_TABLE_LOG - highBit32(x);
+        dt[u].sym = s;
+        dt[u].nbBits = (u8) nbBits;
+        dt[u].newState = (uint16_t) ((x << nbBits) - FSE_TABLE_SIZE);
+    }
+}
+
+
+size_t fseEncode(const u8* in, size_t n, u8* out, size_t cap) {
+    if (n == 0) {
+        // Nothing to normalise, the table log alone is the encoding
+        out[0] = FSE_TABLE_LOG;
+        return 1;
+    }
+    uint64_t counts[256];
+    histogram(in, n, counts);
+    uint16_t norm[256];
+    fseNormalizeCounts(counts, n, norm);
+
+    size_t pos = 0;
+    out[pos++] = FSE_TABLE_LOG;
+    for (int s=0; s < 256; s++) {
+        pos += writeVarint(out + pos, norm[s]);
+    }
+
+    FseEncTable* et = (FseEncTable*) malloc(sizeof(FseEncTable));
+    // Bits emitted per symbol, plus the two final states
+    uint16_t* vals = (uint16_t*) malloc((n + 2) * sizeof(uint16_t));
+    u8* nbs = (u8*) malloc(n + 2);
+    ASSERT(et && vals && nbs, "Error: Out of memory in fseEncode.\n");
+    buildFseEncTable(et, norm);
+
+    uint32_t states[2] = {FSE_TABLE_SIZE, FSE_TABLE_SIZE};
+    for (size_t i=n; i-- > 0; ) {
+        uint32_t* state = &states[i & 1];
+        const FseSymbolTransform tt = et->symbolTT[in[i]];
+        uint32_t nbBits = (*state + tt.deltaNbBits) >> 16;
+        vals[i + 2] = (uint16_t) (*state & ((1u << nbBits) - 1));
+        nbs[i + 2] = (u8) nbBits;
+        *state = et->stateTable[(*state >> nbBits) + tt.deltaFindState];
+    }
+    vals[0] = (uint16_t) (states[0] - FSE_TABLE_SIZE);
+    nbs[0] = FSE_TABLE_LOG;
+    vals[1] = (uint16_t) (states[1] - FSE_TABLE_SIZE);
+    nbs[1] = FSE_TABLE_LOG;
+
+    BitStream bs;
+    bsWriterFromBuffer(&bs, out + pos, cap - pos);
+    for (size_t i=0; i < n + 2; i++) {
+        bsPutBits(&bs, vals[i], nbs[i]);
+    }
+    pos += bsFlush(&bs);
+
+    free(nbs);
+    free(vals);
+    free(et);
+    return pos;
+}
+
+
+// Read n bits where n can be 0
+static inline uint32_t bsReadBits0(BitStream* bs, int n) {
+    uint32_t v = (uint32_t) ((bs->acc >> 1) >> (63 - n));
+    bsSkipBits(bs, n);
+    return v;
+}
+
+
+void fseDecode(const u8* in, size_t size, u8* out, size_t n) {
+    const u8* p = in;
+    const u8* end = in + size;
+    ASSERT(size > 0 && *p++ == FSE_TABLE_LOG, "Error in fseDecode: Unsupported table log.\n");
+    if (n == 0) {
+        return;
+    }
+    uint16_t norm[256];
+    int sum = 0;
+    for (int s=0; s < 256; s++) {
+        norm[s] = (uint16_t) readVarint(&p, end);
+        sum += norm[s];
+    }
+    ASSERT(sum == FSE_TABLE_SIZE, "Error in fseDecode: Corrupt normalised counts.\n");
+    FseDecEntry dt[FSE_TABLE_SIZE];
+    buildFseDecTable(dt, norm);
+
+    BitStream bs;
+    bsReaderFromBuffer(&bs, p, end - p);
+    bsRefillFast(&bs);
+    uint32_t state0 = bsReadBits0(&bs, FSE_TABLE_LOG);
+    uint32_t state1 = bsReadBits0(&bs, FSE_TABLE_LOG);
+
+    size_t i = 0;
+    // 4 symbols of at most FSE_TABLE_LOG bits fit in one refill
+    for (; i + 4 <= n; i += 4) {
+        bsRefillFast(&bs);
+        for (int k=0; k < 4; k += 2) {
+            FseDecEntry e0 = dt[state0];
+            FseDecEntry e1 = dt[state1];
+            out[i + k] = e0.sym;
+            state0 = e0.newState + bsReadBits0(&bs, e0.nbBits);
+            out[i + k + 1] = e1.sym;
+            state1 = e1.newState + bsReadBits0(&bs, e1.nbBits);
+        }
+    }
+    for (; i < n; i++) {
+        bsRefillFast(&bs);
+        uint32_t* state = i & 1 ? &state1 : &state0;
+        FseDecEntry e = dt[*state];
+        out[i] = e.sym;
+        *state = e.newState + bsReadBits0(&bs, e.nbBits);
+    }
+}
+
+
+const BlockCodec fseBlockCodec = {
+    fseEncode,
+    fseDecode,
+    FSE_BLOCK_SIZE,
+    FSE_BOUND(FSE_BLOCK_SIZE),
+    HUFF_SLACK
+};
+
+
+void tansCompress(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &fseBlockCodec);
+}
+
+
+void tansDecompress(FILE* infp, FILE* outfp) {
+    blockDecompress(infp, outfp, &fseBlockCodec);
+}
+
+
+/*
+ *  Static range coding
+ *
+ *  Uses the exact byte counts of the whole file (32 bit frequencies, only scaled
+ *  down for files over 4 GiB) so there is no rounding to a table size or to whole
+ *  bit code lengths. The range is 56 bits and is renormalised a byte at a time once
+ *  it drops below 2^48, so even the largest total still divides it finely. Carries
+ *  are held back in a cached byte and a run of 0xFF bytes.
+ *
+ *  Format: byte count (64 bit), frequencies (varints), then the coded bytes.
+ *
+ *  NOTE: Two passes over the input, does not work with stdin
+ */
+#define RC_TOP_BITS 56
+#define RC_BOT_BITS 48
+#define RC_LOOKUP_BITS 12
+
+typedef struct RangeEnc {
+    uint64_t low;
+    uint64_t range;
+    u8 cache;
+    uint64_t cacheSize;
+    ByteWriter out;
+} RangeEnc;
+
+typedef struct RangeDec {
+    uint64_t code;
+    uint64_t range;
+    ByteReader in;
+} RangeDec;
+
+
+// Scale counts so the total fits in 32 bits. Exact unless the file is over 4 GiB.
+uint64_t rcFreqsFromCounts(const uint64_t* counts, uint32_t* freqs) {
+    for (int shift=0; ; shift++) {
+        uint64_t total = 0;
+        for (int s=0; s < 256; s++) {
+            freqs[s] = 0;
+            if (counts[s]) {
+                uint64_t f = counts[s] >> shift;
+                freqs[s] = (uint32_t) (f ? f : 1);
+            }
+            total += freqs[s];
+        }
+        if (total <= UINT32_MAX) {
+            return total;
+        }
+    }
+}
+
+
+static inline void rcPutByte(RangeEnc* rc, u8 b) {
+    bwPut(&rc->out, b);
+}
+
+
+static void rcShiftLow(RangeEnc* rc) {
+    const uint64_t topByte = 0xffull << RC_BOT_BITS;
+    if (rc->low < topByte || rc->low >> RC_TOP_BITS) {
+        // The top byte is settled, along with any pending 0xFF bytes behind the cache
+        u8 carry = (u8) (rc->low >> RC_TOP_BITS);
+        u8 b = rc->cache;
+        do {
+            rcPutByte(rc, (u8) (b + carry));
+            b = 0xff;
+        } while (--rc->cacheSize);
+        rc->cache = (u8) (rc->low >> RC_BOT_BITS);
+    }
+    rc->cacheSize++;
+    rc->low = (rc->low & ((1ull << RC_BOT_BITS) - 1)) << 8;
+}
+
+
+// 2^64 / total, rounded down (total > 1)
+static inline uint64_t rcReciprocal(uint64_t total) {
+    return total > 1 ? (uint64_t) (((unsigned __int128) 1 << 64) / total) : 0;
+}
+
+
+// range / total, possibly one short, which is fine as both sides do the same
+static inline uint64_t rcScale(uint64_t range, uint64_t total, uint64_t recip) {
+    return total > 1 ? (uint64_t) (((unsigned __int128) range * recip) >> 64) : range;
+}
+
+
+static inline void rcEncode(RangeEnc* rc, uint32_t cumFreq, uint32_t freq, uint64_t total, uint64_t recip) {
+    uint64_t r = rcScale(rc->range, total, recip);
+    rc->low += r * cumFreq;
+    rc->range = r * freq;
+    while (rc->range < (1ull << RC_BOT_BITS)) {
+        rc->range <<= 8;
+        rcShiftLow(rc);
+    }
+}
+
+
+static inline u8 rcGetByte(RangeDec* rc) {
+    int c = brGet(&rc->in);
+    return c == EOF ? 0 : (u8) c;
+}
+
+
+uint64_t readVarintFile(FILE* fp) {
+    uint64_t v = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        int c = fgetc(fp);
+        ASSERT(c != EOF, "Error in readVarintFile: Unexpected end of file.\n");
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+
+uint64_t brVarint(ByteReader* br) {
+    uint64_t v = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        int c = brGet(br);
+        ASSERT(c != EOF, "Error in brVarint: Unexpected end of file.\n");
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+
+void rangeCompress(FILE* infp, FILE* outfp) {
+    uint64_t counts[256];
+    uint64_t nBytes = countCharFreqs(infp, counts);
+    uint32_t freqs[256];
+    uint64_t total = rcFreqsFromCounts(counts, freqs);
+    uint32_t cumFreqs[256];
+    uint64_t cum = 0;
+    for (int s=0; s < 256; s++) {
+        cumFreqs[s] = (uint32_t) cum;
+        cum += freqs[s];
+    }
+
+    writeInt64(outfp, nBytes);
+    u8 header[256 * 5];
+    size_t headerSize = 0;
+    for (int s=0; s < 256; s++) {
+        headerSize += writeVarint(header + headerSize, freqs[s]);
+    }
+    fwrite(header, 1, headerSize, outfp);
+    if (nBytes == 0) {
+        return;
+    }
+
+    uint64_t recip = rcReciprocal(total);
+    RangeEnc rc = {0, (1ull << RC_TOP_BITS) - 1, 0, 1};
+    bwOpen(&rc.out, outfp);
+    ByteReader br;
+    brOpen(&br, infp);
+    const u8* in;
+    size_t n;
+    while ((n = brSpan(&br, &in)) > 0) {
+        for (size_t i=0; i < n; i++) {
+            rcEncode(&rc, cumFreqs[in[i]], freqs[in[i]], total, recip);
+        }
+        brSkip(&br, n);
+    }
+    // The cached byte and all RC_TOP_BITS of low
+    for (int i=0; i <= RC_TOP_BITS / 8; i++) {
+        rcShiftLow(&rc);
+    }
+    brClose(&br);
+    bwClose(&rc.out);
+}
+
+
+void rangeDecompress(FILE* infp, FILE* outfp) {
+    uint64_t nBytes = readInt64(infp);
+    uint32_t freqs[256];
+    uint32_t cumFreqs[257];
+    uint64_t total = 0;
+    for (int s=0; s < 256; s++) {
+        uint64_t f = readVarintFile(infp);
+        ASSERT(f <= UINT32_MAX, "Error in rangeDecompress: Corrupt frequencies.\n");
+        freqs[s] = (uint32_t) f;
+        cumFreqs[s] = (uint32_t) total;
+        total += freqs[s];
+    }
+    cumFreqs[256] = (uint32_t) total;
+    ASSERT(total <= UINT32_MAX && (total > 0 || nBytes == 0), "Error in rangeDecompress: Corrupt frequencies.\n");
+    if (nBytes == 0) {
+        return;
+    }
+
+    // First symbol that could hold each slice of the cumulative frequencies
+    int shift = 0;
+    while ((total - 1) >> shift >> RC_LOOKUP_BITS) {
+        shift++;
+    }
+    u8 lookup[1 << RC_LOOKUP_BITS];
+    int s = 0;
+    for (uint64_t i=0; i < (1 << RC_LOOKUP_BITS); i++) {
+        while (s < 255 && cumFreqs[s + 1] <= (i << shift)) {
+            s++;
+        }
+        lookup[i] = (u8) s;
+    }
+
+    uint64_t recip = rcReciprocal(total);
+    RangeDec rc = {0, (1ull << RC_TOP_BITS) - 1};
+    brOpen(&rc.in, infp);
+    ByteWriter bw;
+    bwOpen(&bw, outfp);
+    // The first byte is the encoder's empty cache
+    for (int i=0; i <= RC_TOP_BITS / 8; i++) {
+        rc.code = (rc.code << 8) | rcGetByte(&rc);
+    }
+    while (nBytes > 0) {
+        u8* out;
+        size_t n = bwSpan(&bw, &out);
+        n = nBytes < n ? nBytes : n;
+        for (size_t i=0; i < n; i++) {
+            uint64_t r = rcScale(rc.range, total, recip);
+            uint64_t v = rc.code / r;
+            v = v < total ? v : total - 1;
+            int sym = lookup[v >> shift];
+            while (cumFreqs[sym + 1] <= v) {
+                sym++;
+            }
+            out[i] = (u8) sym;
+            rc.code -= r * cumFreqs[sym];
+            rc.range = r * freqs[sym];
+            while (rc.range < (1ull << RC_BOT_BITS)) {
+                rc.range <<= 8;
+                rc.code = (rc.code << 8) | rcGetByte(&rc);
+            }
+        }
+        bwCommit(&bw, n);
+        nBytes -= n;
+    }
+    bwClose(&bw);
+    brClose(&rc.in);
+}
+
+
+/*
+ *  Context mixing (high ratio mode)
+ *
+ *  Bits are coded one at a time with a binary arithmetic coder. Each bit is predicted
+ *  by CM_N_CTX hashed context models (orders 1, 2, 3, 4, 6 and the current word) and
+ *  a match model that follows the last time the previous CM_MATCH_MIN bytes were
+ *  seen. The predictions are combined by a logistic mixer chosen by the bits of the
+ *  byte so far, then refined by an APM (adaptive probability map) on the order-1
+ *  context.
+ *
+ *  Model memory is 2^memLog bytes, split between the context tables (3/4), the match
+ *  table and the match history. COMP_CM_MEM sets it in MiB, the default is 64 MiB.
+ *  The decoder must use the same, so it is stored up front.
+ *
+ *  Format: memLog byte, then chunks framed by their raw and coded size (32 bit each).
+ *  The model carries across chunks, only the arithmetic coder restarts.
+ */
+#define CM_DEFAULT_MEM_LOG 26
+#define CM_MIN_MEM_LOG 20
+#define CM_MAX_MEM_LOG 32
+#define CM_CHUNK_SIZE (1 << 20)
+#define CM_N_CTX 6
+// Context models, match model and a bias
+#define CM_N_INPUTS (CM_N_CTX + 2)
+#define CM_MATCH_MIN 6
+#define CM_MATCH_BUCKETS 16
+// Counts adapt quickly at first, then settle at about 1/CM_COUNT_LIMIT
+#define CM_COUNT_LIMIT 255
+
+typedef struct CmModel {
+    int memLog;
+    // Each slot: 22 bit probability of a 1 and a 10 bit count
+    uint32_t* slots[CM_N_CTX];
+    uint32_t slotMask;
+    uint32_t bases[CM_N_CTX];
+    uint32_t* cur[CM_N_CTX];
+
+    u8* hist;
+    uint32_t histMask;
+    uint32_t* matchTable;
+    uint32_t matchMask;
+    uint32_t matchPtr;
+    int matchLen;
+    int matchIdx;
+    uint32_t matchSlots[CM_MATCH_BUCKETS * 2];
+
+    int32_t weights[256][CM_N_INPUTS];
+    int inputs[CM_N_INPUTS];
+    int prMix;
+
+    uint16_t* apm;
+    int apmIdx;
+    int pr;
+
+    uint32_t pos;
+    // Bits of the current byte with a leading 1
+    int c0;
+    int bitPos;
+    uint32_t c4;
+    uint32_t c8;
+    uint32_t wordHash;
+} CmModel;
+
+
+static short cmStretchTable[4096];
+static short cmSquashTable[4095];
+// 65536 / (n + 1.5) for count based adaption rates
+static int cmRateTable[CM_COUNT_LIMIT + 1];
+
+
+// Logistic function, 12 bit probability from stretch domain (-2047 to 2047)
+static inline int cmSquash(int x) {
+    if (x > 2047) {
+        x = 2047;
+    }
+    if (x < -2047) {
+        x = -2047;
+    }
+    return cmSquashTable[x + 2047];
+}
+
+
+static void cmInitTables(void) {
+    static int done = 0;
+    if (done) {
+        return;
+    }
+    for (int x=-2047; x <= 2047; x++) {
+        cmSquashTable[x + 2047] = (short) (4096.0 / (1.0 + exp(-x / 256.0)));
+    }
+    // Inverse of squash
+    int pi = 0;
+    for (int x=-2047; x <= 2047; x++) {
+        int v = cmSquash(x);
+        for (int i=pi; i <= v && i < 4096; i++) {
+            cmStretchTable[i] = (short) x;
+        }
+        pi = v + 1;
+    }
+    for (int i=pi; i < 4096; i++) {
+        cmStretchTable[i] = 2047;
+    }
+    for (int n=0; n <= CM_COUNT_LIMIT; n++) {
+        cmRateTable[n] = (int) (65536 / (n + 1.5));
+    }
+    done = 1;
+}
+
+
+static inline int cmStretch(int p) {
+    return cmStretchTable[p];
+}
+
+
+static inline uint32_t cmHash(uint32_t a, uint32_t b) {
+    uint32_t h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0xC2B2AE3Du;
+    return h ^ (h >> 13);
+}
+
+
+void cmInit(CmModel* m, int memLog) {
+    cmInitTables();
+    memset(m, 0, sizeof(CmModel));
+    m->memLog = memLog;
+    size_t tableBytes = (size_t) 1 << (memLog - 3);
+    size_t nSlots = tableBytes / sizeof(uint32_t);
+    m->slotMask = (uint32_t) (nSlots - 1);
+    for (int i=0; i < CM_N_CTX; i++) {
+        m->slots[i] = (uint32_t*) malloc(tableBytes);
+        ASSERT(m->slots[i], "Error: Out of memory for context mixing model.\n");
+        // Probability 1/2 with a count of 0
+        for (size_t j=0; j < nSlots; j++) {
+            m->slots[i][j] = 1u << 31;
+        }
+    }
+    m->hist = (u8*) calloc(tableBytes, 1);
+    m->histMask = (uint32_t) (tableBytes - 1);
+    m->matchTable = (uint32_t*) calloc(nSlots, sizeof(uint32_t));
+    m->matchMask = (uint32_t) (nSlots - 1);
+    m->apm = (uint16_t*) malloc(65536 * 33 * sizeof(uint16_t));
+    ASSERT(m->hist && m->matchTable && m->apm, "Error: Out of memory for context mixing model.\n");
+    for (int i=0; i < CM_MATCH_BUCKETS * 2; i++) {
+        m->matchSlots[i] = 1u << 31;
+    }
+    for (int c=0; c < 256; c++) {
+        for (int i=0; i < CM_N_INPUTS; i++) {
+            m->weights[c][i] = (1 << 16) / 4;
+        }
+    }
+    // APM starts out as the identity
+    for (int ctx=0; ctx < 65536; ctx++) {
+        for (int j=0; j < 33; j++) {
+            m->apm[ctx * 33 + j] = (uint16_t) (cmSquash((j - 16) * 128) * 16);
+        }
+    }
+    m->c0 = 1;
+}
+
+
+void cmFree(CmModel* m) {
+    for (int i=0; i < CM_N_CTX; i++) {
+        free(m->slots[i]);
+    }
+    free(m->hist);
+    free(m->matchTable);
+    free(m->apm);
+}
+
+
+// 12 bit probability that the next bit is a 1
+static inline int cmPredict(CmModel* m) {
+    for (int i=0; i < CM_N_CTX; i++) {
+        m->cur[i] = &m->slots[i][m->bases[i] | m->c0];
+        m->inputs[i] = cmStretch(*m->cur[i] >> 20);
+    }
+
+    m->matchIdx = -1;
+    m->inputs[CM_N_CTX] = 0;
+    if (m->matchLen > 0) {
+        int expected = m->hist[m->matchPtr & m->histMask] | 0x100;
+        // Stop following the match once this byte has gone a different way
+        if ((expected >> (8 - m->bitPos)) == m->c0) {
+            int bit = (expected >> (7 - m->bitPos)) & 1;
+            int bucket = m->matchLen < CM_MATCH_BUCKETS ? m->matchLen : CM_MATCH_BUCKETS - 1;
+            m->matchIdx = bucket * 2 + bit;
+            m->inputs[CM_N_CTX] = cmStretch(m->matchSlots[m->matchIdx] >> 20);
+        } else {
+            m->matchLen = 0;
+        }
+    }
+    m->inputs[CM_N_CTX + 1] = 256;
+
+    int64_t dot = 0;
+    int32_t* w = m->weights[m->c0];
+    for (int i=0; i < CM_N_INPUTS; i++) {
+        dot += (int64_t) w[i] * m->inputs[i];
+    }
+    m->prMix = cmSquash((int) (dot >> 16));
+
+    // Interpolate between the two nearest APM buckets
+    int s = cmStretch(m->prMix) + 2048;
+    int lo = s >> 7;
+    int frac = s & 127;
+    int ctx = m->c0 | ((m->c4 & 0xff) << 8);
+    m->apmIdx = ctx * 33 + lo + (frac >> 6);
+    int pa = (m->apm[ctx * 33 + lo] * (128 - frac) + m->apm[ctx * 33 + lo + 1] * frac) >> 11;
+
+    int pr = (m->prMix + 3 * pa) >> 2;
+    m->pr = pr < 1 ? 1 : (pr > 4095 ? 4095 : pr);
+    return m->pr;
+}
+
+
+static inline void cmUpdateSlot(uint32_t* slot, int bit) {
+    uint32_t s = *slot;
+    int n = s & 1023;
+    int p = s >> 10;
+    p += (int) (((int64_t) ((bit << 22) - p) * cmRateTable[n]) >> 16);
+    if (n < CM_COUNT_LIMIT) {
+        n++;
+    }
+    *slot = ((uint32_t) p << 10) | n;
+}
+
+
+static void cmByteUpdate(CmModel* m) {
+    int c = m->c0 & 0xff;
+    m->hist[m->pos & m->histMask] = (u8) c;
+    m->pos++;
+    m->c8 = (m->c8 << 8) | (m->c4 >> 24);
+    m->c4 = (m->c4 << 8) | c;
+
+    // Current word, case folded
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+        m->wordHash = (m->wordHash + (c | 0x20)) * 0x2F0F3A49u;
+    } else if (m->wordHash) {
+        m->wordHash = 0;
+    }
+
+    if (m->matchLen > 0) {
+        // Still matching if the predicted byte came true
+        m->matchLen = m->matchLen < 65535 ? m->matchLen + 1 : m->matchLen;
+        m->matchPtr++;
+    }
+    if (m->pos >= CM_MATCH_MIN) {
+        uint32_t h = cmHash(m->c4, m->c8 & 0xffff) & m->matchMask;
+        if (m->matchLen == 0) {
+            uint32_t cand = m->matchTable[h];
+            if (cand > 0 && m->pos - cand <= m->histMask) {
+                int len = 0;
+                while (len < 32 && (uint32_t) len < cand && m->hist[(cand - 1 - len) & m->histMask] == m->hist[(m->pos - 1 - len) & m->histMask]) {
+                    len++;
+                }
+                if (len >= CM_MATCH_MIN) {
+                    m->matchLen = len;
+                    m->matchPtr = cand;
+                }
+            }
+        }
+        m->matchTable[h] = m->pos;
+    }
+
+    uint32_t ctxs[CM_N_CTX] = {
+        m->c4 & 0xff,
+        m->c4 & 0xffff,
+        m->c4 & 0xffffff,
+        m->c4,
+        cmHash(m->c4, m->c8 & 0xffff),
+        cmHash(m->wordHash, m->c4 & 0xff),
+    };
+    for (int i=0; i < CM_N_CTX; i++) {
+        // Each context gets a 256 slot bucket, indexed by the bits of the byte so far
+        m->bases[i] = cmHash(ctxs[i], i) & m->slotMask & ~0xffu;
+    }
+    m->c0 = 1;
+    m->bitPos = 0;
+}
+
+
+static inline void cmUpdate(CmModel* m, int bit) {
+    for (int i=0; i < CM_N_CTX; i++) {
+        cmUpdateSlot(m->cur[i], bit);
+    }
+    if (m->matchIdx >= 0) {
+        cmUpdateSlot(&m->matchSlots[m->matchIdx], bit);
+    }
+
+    int err = (bit << 12) - m->prMix;
+    int32_t* w = m->weights[m->c0];
+    for (int i=0; i < CM_N_INPUTS; i++) {
+        w[i] += (m->inputs[i] * err) >> 13;
+    }
+
+    m->apm[m->apmIdx] += ((bit << 16) - m->apm[m->apmIdx]) >> 6;
+
+    m->c0 = (m->c0 << 1) | bit;
+    m->bitPos++;
+    if (m->bitPos == 8) {
+        cmByteUpdate(m);
+    }
+}
+
+
+// Binary arithmetic coder over 12 bit probabilities, carryless
+typedef struct ArithCoder {
+    uint32_t x1;
+    uint32_t x2;
+    uint32_t x;
+    u8* buf;
+    size_t pos;
+    size_t cap;
+} ArithCoder;
+
+
+static void acPutByte(ArithCoder* ac, u8 b) {
+    if (ac->pos == ac->cap) {
+        ac->cap *= 2;
+        ac->buf = (u8*) realloc(ac->buf, ac->cap);
+        ASSERT(ac->buf, "Error: Out of memory in arithmetic coder.\n");
+    }
+    ac->buf[ac->pos++] = b;
+}
+
+
+static inline void acEncode(ArithCoder* ac, int bit, int p) {
+    uint32_t xmid = ac->x1 + (uint32_t) (((uint64_t) (ac->x2 - ac->x1) * p) >> 12);
+    if (bit) {
+        ac->x2 = xmid;
+    } else {
+        ac->x1 = xmid + 1;
+    }
+    while (((ac->x1 ^ ac->x2) & 0xff000000) == 0) {
+        acPutByte(ac, (u8) (ac->x2 >> 24));
+        ac->x1 <<= 8;
+        ac->x2 = (ac->x2 << 8) | 255;
+    }
+}
+
+
+static inline int acDecode(ArithCoder* ac, int p) {
+    uint32_t xmid = ac->x1 + (uint32_t) (((uint64_t) (ac->x2 - ac->x1) * p) >> 12);
+    int bit = ac->x <= xmid;
+    if (bit) {
+        ac->x2 = xmid;
+    } else {
+        ac->x1 = xmid + 1;
+    }
+    while (((ac->x1 ^ ac->x2) & 0xff000000) == 0) {
+        ac->x1 <<= 8;
+        ac->x2 = (ac->x2 << 8) | 255;
+        ac->x = (ac->x << 8) | (ac->pos < ac->cap ? ac->buf[ac->pos++] : 0);
+    }
+    return bit;
+}
+
+
+int cmMemLogFromEnv(void) {
+    char* env = getenv("COMP_CM_MEM");
+    if (!env) {
+        return CM_DEFAULT_MEM_LOG;
+    }
+    int memLog = CM_MIN_MEM_LOG;
+    while (memLog < CM_MAX_MEM_LOG && ((size_t) 1 << (memLog + 1)) <= (size_t) atol(env) << 20) {
+        memLog++;
+    }
+    return memLog;
+}
+
+
+void cmCompress(FILE* infp, FILE* outfp) {
+    int memLog = cmMemLogFromEnv();
+    CmModel* m = (CmModel*) malloc(sizeof(CmModel));
+    ASSERT(m, "Error: Out of memory in cmCompress.\n");
+    cmInit(m, memLog);
+    fputc(memLog, outfp);
+
+    u8* in = (u8*) malloc(CM_CHUNK_SIZE);
+    ArithCoder ac;
+    ac.cap = CM_CHUNK_SIZE;
+    ac.buf = (u8*) malloc(ac.cap);
+    ASSERT(in && ac.buf, "Error: Out of memory in cmCompress.\n");
+    size_t n;
+    while ((n = fread(in, 1, CM_CHUNK_SIZE, infp)) > 0) {
+        ac.x1 = 0;
+        ac.x2 = 0xffffffff;
+        ac.pos = 0;
+        for (size_t i=0; i < n; i++) {
+            for (int j=7; j >= 0; j--) {
+                int bit = (in[i] >> j) & 1;
+                acEncode(&ac, bit, cmPredict(m));
+                cmUpdate(m, bit);
+            }
+        }
+        // Enough of x1 to land inside the final range
+        for (int i=0; i < 4; i++) {
+            acPutByte(&ac, (u8) (ac.x1 >> (24 - 8*i)));
+        }
+        u8 frame[8];
+        writeLE32(frame, (uint32_t) n);
+        writeLE32(frame + 4, (uint32_t) ac.pos);
+        fwrite(frame, 1, 8, outfp);
+        fwrite(ac.buf, 1, ac.pos, outfp);
+    }
+    free(ac.buf);
+    free(in);
+    cmFree(m);
+    free(m);
+}
+
+
+void cmDecompress(FILE* infp, FILE* outfp) {
+    int memLog = fgetc(infp);
+    if (memLog == EOF) {
+        return;
+    }
+    ASSERT(memLog >= CM_MIN_MEM_LOG && memLog <= CM_MAX_MEM_LOG, "Error in cmDecompress: Bad model size.\n");
+    CmModel* m = (CmModel*) malloc(sizeof(CmModel));
+    ASSERT(m, "Error: Out of memory in cmDecompress.\n");
+    cmInit(m, memLog);
+
+    u8* out = (u8*) malloc(CM_CHUNK_SIZE);
+    size_t codedCap = CM_CHUNK_SIZE;
+    ArithCoder ac;
+    ac.buf = (u8*) malloc(codedCap);
+    ASSERT(out && ac.buf, "Error: Out of memory in cmDecompress.\n");
+    u8 frame[8];
+    size_t got;
+    while ((got = fread(frame, 1, 8, infp)) == 8) {
+        size_t n = readLE32(frame);
+        size_t size = readLE32(frame + 4);
+        ASSERT(n <= CM_CHUNK_SIZE, "Error in cmDecompress: Corrupt chunk frame.\n");
+        if (size > codedCap) {
+            codedCap = size;
+            ac.buf = (u8*) realloc(ac.buf, codedCap);
+            ASSERT(ac.buf, "Error: Out of memory in cmDecompress.\n");
+        }
+        ASSERT(fread(ac.buf, 1, size, infp) == size, "Error in cmDecompress: Unexpected end of file.\n");
+        ac.x1 = 0;
+        ac.x2 = 0xffffffff;
+        ac.x = 0;
+        ac.pos = 0;
+        ac.cap = size;
+        for (int i=0; i < 4; i++) {
+            ac.x = (ac.x << 8) | (ac.pos < ac.cap ? ac.buf[ac.pos++] : 0);
+        }
+        for (size_t i=0; i < n; i++) {
+            int c = 0;
+            for (int j=0; j < 8; j++) {
+                int bit = acDecode(&ac, cmPredict(m));
+                cmUpdate(m, bit);
+                c = (c << 1) | bit;
+            }
+            out[i] = (u8) c;
+        }
+        fwrite(out, 1, n, outfp);
+    }
+    ASSERT(got == 0, "Error in cmDecompress: Unexpected end of file in chunk frame.\n");
+    free(ac.buf);
+    free(out);
+    cmFree(m);
+    free(m);
+}
+
+
+/*
+ *  Burrows-Wheeler transform
+ *
+ *  Suffix arrays are built with SA-IS (induced sorting, linear time). The text gets
+ *  a virtual sentinel smaller than every byte, so symbols are shifted up by one at
+ *  the top level. LMS substrings are named and, if the names aren't unique, sorted
+ *  by recursing on the reduced string, which lives in the back half of the suffix
+ *  array.
+ *
+ *  The inverse walks psi (the row holding the next suffix) from BWT_STREAMS points
+ *  spread evenly over the block, all in lockstep, so the cache misses of one walk
+ *  overlap with the others. The rows of those points are stored with the block.
+ *
+ *  Block format: BWT_STREAMS rows (32 bit each, the first is the sentinel row),
+ *  then the last column without the sentinel.
+ */
+#define BWT_BLOCK_SIZE (1 << 25)
+#define BWT_STREAMS 8
+#define BWT_HEADER_SIZE (4 * BWT_STREAMS)
+
+typedef struct SaisText {
+    // Exactly one is set
+    const u8* bytes;
+    const int32_t* ints;
+    int n;
+} SaisText;
+
+
+static inline int saisChr(const SaisText* s, int i) {
+    if (s->bytes) {
+        return i == s->n - 1 ? 0 : s->bytes[i] + 1;
+    }
+    return s->ints[i];
+}
+
+
+// S type positions have their bit set
+static inline int saisIsS(const u8* types, int i) {
+    return (types[i >> 3] >> (i & 7)) & 1;
+}
+
+
+static inline int saisIsLMS(const u8* types, int i) {
+    return i > 0 && saisIsS(types, i) && !saisIsS(types, i - 1);
+}
+
+
+static void saisBuckets(const SaisText* s, int32_t* bkt, int k, int ends) {
+    memset(bkt, 0, (k + 1) * sizeof(int32_t));
+    for (int i=0; i < s->n; i++) {
+        bkt[saisChr(s, i)]++;
+    }
+    int32_t sum = 0;
+    for (int c=0; c <= k; c++) {
+        sum += bkt[c];
+        bkt[c] = ends ? sum : sum - bkt[c];
+    }
+}
+
+
+static void saisInduce(const SaisText* s, const u8* types, int32_t* sa, int32_t* bkt, int k) {
+    // L type suffixes from the front of each bucket, left to right
+    saisBuckets(s, bkt, k, 0);
+    for (int i=0; i < s->n; i++) {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && !saisIsS(types, j)) {
+            sa[bkt[saisChr(s, j)]++] = j;
+        }
+    }
+    // Then S type suffixes from the end of each bucket, right to left
+    saisBuckets(s, bkt, k, 1);
+    for (int i=s->n - 1; i >= 0; i--) {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && saisIsS(types, j)) {
+            sa[--bkt[saisChr(s, j)]] = j;
+        }
+    }
+}
+
+
+/*
+ *  Suffix array of s, whose last symbol must be a unique smallest sentinel. k is the
+ *  largest symbol.
+ */
+static void sais(const SaisText* s, int32_t* sa, int k) {
+    int n = s->n;
+    u8* types = (u8*) calloc(n / 8 + 1, 1);
+    int32_t* bkt = (int32_t*) malloc((k + 1) * sizeof(int32_t));
+    ASSERT(types && bkt, "Error: Out of memory in sais.\n");
+
+    types[(n - 1) >> 3] |= 1 << ((n - 1) & 7);
+    for (int i=n - 2; i >= 0; i--) {
+        int c = saisChr(s, i);
+        int next = saisChr(s, i + 1);
+        if (c < next || (c == next && saisIsS(types, i + 1))) {
+            types[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    // Sort LMS substrings by placing them at their bucket ends and inducing
+    saisBuckets(s, bkt, k, 1);
+    for (int i=0; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (int i=1; i < n; i++) {
+        if (saisIsLMS(types, i)) {
+            sa[--bkt[saisChr(s, i)]] = i;
+        }
+    }
+    saisInduce(s, types, sa, bkt, k);
+
+    // Compact the sorted LMS substrings to the front and name them
+    int n1 = 0;
+    for (int i=0; i < n; i++) {
+        if (saisIsLMS(types, sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (int i=n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    int name = 0;
+    int prev = -1;
+    for (int i=0; i < n1; i++) {
+        int pos = sa[i];
+        int diff = 0;
+        for (int d=0; d < n; d++) {
+            if (prev == -1 || saisChr(s, pos + d) != saisChr(s, prev + d) || saisIsS(types, pos + d) != saisIsS(types, prev + d)) {
+                diff = 1;
+                break;
+            } else if (d > 0 && (saisIsLMS(types, pos + d) || saisIsLMS(types, prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        // LMS positions are at least 2 apart so pos / 2 is a unique slot
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (int i=n - 1, j=n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) {
+            sa[j--] = sa[i];
+        }
+    }
+
+    // Order the LMS suffixes, recursing when names repeat
+    int32_t* sa1 = sa;
+    int32_t* s1 = sa + n - n1;
+    if (name < n1) {
+        SaisText t1 = {NULL, s1, n1};
+        sais(&t1, sa1, name - 1);
+    } else {
+        for (int i=0; i < n1; i++) {
+            sa1[s1[i]] = i;
+        }
+    }
+
+    // Put the sorted LMS suffixes at their bucket ends and induce the rest
+    for (int i=1, j=0; i < n; i++) {
+        if (saisIsLMS(types, i)) {
+            s1[j++] = i;
+        }
+    }
+    for (int i=0; i < n1; i++) {
+        sa1[i] = s1[sa1[i]];
+    }
+    for (int i=n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    saisBuckets(s, bkt, k, 1);
+    for (int i=n1 - 1; i >= 0; i--) {
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[saisChr(s, j)]] = j;
+    }
+    saisInduce(s, types, sa, bkt, k);
+
+    free(bkt);
+    free(types);
+}
+
+
+size_t bwtEncode(const u8* in, size_t n, u8* out, size_t cap) {
+    ASSERT(cap >= n + BWT_HEADER_SIZE, "Error in bwtEncode: Output buffer too small.\n");
+    int32_t* sa = (int32_t*) malloc((n + 1) * sizeof(int32_t));
+    ASSERT(sa, "Error: Out of memory in bwtEncode.\n");
+    SaisText text = {in, NULL, (int) n + 1};
+    sais(&text, sa, 256);
+
+    size_t step = (n + BWT_STREAMS - 1) / BWT_STREAMS;
+    uint32_t rows[BWT_STREAMS] = {0};
+    u8* last = out + BWT_HEADER_SIZE;
+    size_t j = 0;
+    for (size_t i=0; i <= n; i++) {
+        size_t pos = sa[i];
+        if (pos % step == 0 && pos < n) {
+            rows[pos / step] = (uint32_t) i;
+        }
+        if (pos > 0) {
+            last[j++] = in[pos - 1];
+        }
+    }
+    for (int r=0; r < BWT_STREAMS; r++) {
+        writeLE32(out + 4 * r, rows[r]);
+    }
+    free(sa);
+    return n + BWT_HEADER_SIZE;
+}
+
+
+void bwtDecode(const u8* in, size_t size, u8* out, size_t n) {
+    ASSERT(size == n + BWT_HEADER_SIZE, "Error in bwtDecode: Corrupt block size.\n");
+    uint32_t rows[BWT_STREAMS];
+    for (int r=0; r < BWT_STREAMS; r++) {
+        rows[r] = readLE32(in + 4 * r);
+        ASSERT(rows[r] <= n, "Error in bwtDecode: Corrupt row index.\n");
+    }
+    const u8* last = in + BWT_HEADER_SIZE;
+    size_t primary = rows[0];
+
+    // Rows are numbered with the sentinel, which sorts first and isn't stored
+    uint32_t starts[256];
+    uint64_t counts[256];
+    histogram(last, n, counts);
+    uint32_t sum = 1;
+    for (int c=0; c < 256; c++) {
+        starts[c] = sum;
+        sum += (uint32_t) counts[c];
+    }
+    uint32_t* psi = (uint32_t*) malloc((n + 1) * sizeof(uint32_t));
+    ASSERT(psi, "Error: Out of memory in bwtDecode.\n");
+    psi[0] = (uint32_t) primary;
+    for (size_t i=0; i < n; i++) {
+        size_t row = i + (i >= primary);
+        psi[starts[last[i]]++] = (uint32_t) row;
+    }
+
+    size_t step = (n + BWT_STREAMS - 1) / BWT_STREAMS;
+    size_t pos[BWT_STREAMS];
+    size_t lens[BWT_STREAMS];
+    uint32_t cur[BWT_STREAMS];
+    size_t minLen = step;
+    for (int r=0; r < BWT_STREAMS; r++) {
+        pos[r] = r * step;
+        lens[r] = pos[r] < n ? (n - pos[r] < step ? n - pos[r] : step) : 0;
+        minLen = lens[r] < minLen ? lens[r] : minLen;
+        cur[r] = rows[r];
+    }
+
+    // Every row but the sentinel's is one past its stored index
+    for (size_t t=0; t < minLen; t++) {
+        for (int r=0; r < BWT_STREAMS; r++) {
+            uint32_t row = psi[cur[r]];
+            cur[r] = row;
+            out[pos[r] + t] = last[row - (row > primary)];
+        }
+    }
+    for (int r=0; r < BWT_STREAMS; r++) {
+        for (size_t t=minLen; t < lens[r]; t++) {
+            uint32_t row = psi[cur[r]];
+            cur[r] = row;
+            out[pos[r] + t] = last[row - (row > primary)];
+        }
+    }
+    free(psi);
+}
+
+
+const BlockCodec bwtBlockCodec = {
+    bwtEncode,
+    bwtDecode,
+    BWT_BLOCK_SIZE,
+    BWT_BLOCK_SIZE + BWT_HEADER_SIZE,
+    0,
+    1
+};
+
+
+void bwtTransform(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &bwtBlockCodec);
+}
+
+
+void invBWTTransform(FILE* infp, FILE* outfp) {
+    blockDecompress(infp, outfp, &bwtBlockCodec);
+}
+
+
+/*
+ *  LZ77
+ *
+ *  Blocks are parsed into sequences of literals followed by a match (length and
+ *  offset back into the block). The sequences are split into streams so each gets
+ *  its own statistics: literals, literal lengths, match lengths and offset codes go
+ *  through block Huffman coding, while length overflows and the low bits of offsets
+ *  are stored as they are.
+ *
+ *  Lengths under 255 take one byte, 255 means the rest follows as a varint in the
+ *  overflow stream. An offset is coded as its top bit position plus the bits below
+ *  it. The last sequence of a block may have literals and no match.
+ *
+ *  Matches come from hash chains over a window of 2^windowLog bytes, following at
+ *  most depth links, with one step of lazy evaluation (or an optimal parse, below).
+ *  COMP_LZ_WINDOW (log2) and COMP_LZ_DEPTH override the defaults. The decoder
+ *  doesn't need either.
+ *
+ *  Block format: for each stream its raw and coded size (varints) then the data,
+ *  stored when coding didn't make it smaller.
+ */
+#define LZ_BLOCK_SIZE (1 << 24)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 18
+#define LZ_DEFAULT_WINDOW_LOG 22
+#define LZ_DEFAULT_DEPTH 32
+#define LZ_SLACK 32
+#define LZ_NUM_STREAMS 6
+// Huffman coded streams come first
+#define LZ_NUM_CODED 4
+// A 4 byte match can take 6 bytes before entropy coding
+#define LZ_BOUND(n) (2 * (n) + 1024)
+
+typedef struct LzParams {
+    int windowLog;
+    int depth;
+} LzParams;
+
+typedef struct LzStreams {
+    // Literals, literal lengths, match lengths, offset codes, length overflows, offset bits
+    u8* bufs[LZ_NUM_STREAMS];
+    size_t lens[LZ_NUM_STREAMS];
+    BitStream offBits;
+} LzStreams;
+
+enum {LZ_LITS, LZ_LIT_LENS, LZ_MATCH_LENS, LZ_OFF_CODES, LZ_LEN_EXTRA, LZ_OFF_BITS};
+
+
+void lzParamsFromEnv(LzParams* params, int defaultDepth) {
+    char* env = getenv("COMP_LZ_WINDOW");
+    params->windowLog = env ? atoi(env) : LZ_DEFAULT_WINDOW_LOG;
+    if (params->windowLog < 10) {
+        params->windowLog = 10;
+    }
+    if (params->windowLog > 24) {
+        params->windowLog = 24;
+    }
+    env = getenv("COMP_LZ_DEPTH");
+    params->depth = env ? atoi(env) : defaultDepth;
+    if (params->depth < 1) {
+        params->depth = 1;
+    }
+}
+
+
+static void lzAllocStreams(LzStreams* s, size_t n) {
+    for (int i=0; i < LZ_NUM_STREAMS; i++) {
+        // Worst case is a literal length, match length, offset code and varint per
+        // 4 bytes, or all literals
+        s->bufs[i] = (u8*) malloc(n + 16);
+        ASSERT(s->bufs[i], "Error: Out of memory in lzAllocStreams.\n");
+        s->lens[i] = 0;
+    }
+    bsWriterFromBuffer(&s->offBits, s->bufs[LZ_OFF_BITS], n + 16);
+}
+
+
+static void lzFreeStreams(LzStreams* s) {
+    for (int i=0; i < LZ_NUM_STREAMS; i++) {
+        free(s->bufs[i]);
+    }
+}
+
+
+static inline void lzPutLen(LzStreams* s, int stream, size_t len) {
+    if (len < 255) {
+        s->bufs[stream][s->lens[stream]++] = (u8) len;
+    } else {
+        s->bufs[stream][s->lens[stream]++] = 255;
+        s->lens[LZ_LEN_EXTRA] += writeVarint(s->bufs[LZ_LEN_EXTRA] + s->lens[LZ_LEN_EXTRA], len - 255);
+    }
+}
+
+
+// Literals then a match, or just literals (matchLen 0) at the end of a block
+static inline void lzPutSeq(LzStreams* s, const u8* lits, size_t litLen, size_t matchLen, uint32_t offset) {
+    memcpy(s->bufs[LZ_LITS] + s->lens[LZ_LITS], lits, litLen);
+    s->lens[LZ_LITS] += litLen;
+    lzPutLen(s, LZ_LIT_LENS, litLen);
+    if (matchLen == 0) {
+        return;
+    }
+    lzPutLen(s, LZ_MATCH_LENS, matchLen - LZ_MIN_MATCH);
+    int code = highBit32(offset);
+    s->bufs[LZ_OFF_CODES][s->lens[LZ_OFF_CODES]++] = (u8) code;
+    if (code > 0) {
+        bsPutBits(&s->offBits, offset & ((1u << code) - 1), code);
+    }
+}
+
+
+static inline uint32_t lzHash4(const u8* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+// Length of the common prefix of a and b, at most limit
+static inline size_t lzMatchLen(const u8* a, const u8* b, size_t limit) {
+    size_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if (x != y) {
+            return len + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len]) {
+        len++;
+    }
+    return len;
+}
+
+
+typedef struct LzChains {
+    // Positions plus one, 0 is empty
+    uint32_t* head;
+    uint32_t* prev;
+    uint32_t windowMask;
+} LzChains;
+
+
+static void lzAllocChains(LzChains* c, int windowLog) {
+    c->head = (uint32_t*) calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+    c->prev = (uint32_t*) malloc(((size_t) 1 << windowLog) * sizeof(uint32_t));
+    ASSERT(c->head && c->prev, "Error: Out of memory in lzAllocChains.\n");
+    c->windowMask = (1u << windowLog) - 1;
+}
+
+
+static void lzFreeChains(LzChains* c) {
+    free(c->head);
+    free(c->prev);
+}
+
+
+static inline void lzInsert(LzChains* c, const u8* in, size_t pos) {
+    uint32_t h = lzHash4(in + pos);
+    c->prev[pos & c->windowMask] = c->head[h];
+    c->head[h] = (uint32_t) pos + 1;
+}
+
+
+// Longest match for pos among earlier positions, inserting pos. Returns its length.
+static size_t lzFindMatch(LzChains* c, const u8* in, size_t pos, size_t n, int depth, uint32_t* offset) {
+    uint32_t h = lzHash4(in + pos);
+    uint32_t cand = c->head[h];
+    c->prev[pos & c->windowMask] = cand;
+    c->head[h] = (uint32_t) pos + 1;
+
+    size_t limit = n - pos;
+    size_t best = LZ_MIN_MATCH - 1;
+    while (cand && depth-- > 0) {
+        size_t candPos = cand - 1;
+        if (pos - candPos > c->windowMask) {
+            break;
+        }
+        // Only worth comparing if it could beat the best so far
+        if (in[candPos + best] == in[pos + best]) {
+            size_t len = lzMatchLen(in + candPos, in + pos, limit);
+            if (len > best) {
+                best = len;
+                *offset = (uint32_t) (pos - candPos);
+                if (len == limit) {
+                    break;
+                }
+            }
+        }
+        cand = c->prev[candPos & c->windowMask];
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+
+// Greedy parse with one step of lazy matching
+static void lzParseLazy(const u8* in, size_t n, const LzParams* params, LzStreams* s) {
+    LzChains c;
+    lzAllocChains(&c, params->windowLog);
+    size_t anchor = 0;
+    size_t pos = 0;
+    // Hashing reads 4 bytes
+    size_t end = n >= LZ_MIN_MATCH ? n - LZ_MIN_MATCH + 1 : 0;
+    while (pos < end) {
+        uint32_t offset = 0;
+        size_t len = lzFindMatch(&c, in, pos, n, params->depth, &offset);
+        if (len == 0) {
+            pos++;
+            continue;
+        }
+        // Take the next position's match instead if it is longer
+        while (pos + 1 < end) {
+            uint32_t nextOffset = 0;
+            size_t nextLen = lzFindMatch(&c, in, pos + 1, n, params->depth, &nextOffset);
+            if (nextLen <= len) {
+                break;
+            }
+            pos++;
+            len = nextLen;
+            offset = nextOffset;
+        }
+
+        lzPutSeq(s, in + anchor, pos - anchor, len, offset);
+        // Positions inside the match go in the chains too. pos + 1 may already be in.
+        size_t matchEnd = pos + len;
+        for (size_t p=pos + 2; p < matchEnd && p < end; p++) {
+            lzInsert(&c, in, p);
+        }
+        pos = matchEnd;
+        anchor = pos;
+    }
+    if (anchor < n) {
+        lzPutSeq(s, in + anchor, n - anchor, 0, 0);
+    }
+    lzFreeChains(&c);
+}
+
+
+// Code each stream and lay them out one after another. Returns the bytes written.
+static size_t lzWriteStreams(LzStreams* s, u8* out, size_t cap) {
+    s->lens[LZ_OFF_BITS] = bsFlush(&s->offBits);
+    size_t pos = 0;
+    for (int i=0; i < LZ_NUM_STREAMS; i++) {
+        size_t n = s->lens[i];
+        ASSERT(pos + 20 + n <= cap, "Error in lzWriteStreams: Output buffer too small.\n");
+        size_t size = n;
+        u8* coded = NULL;
+        if (i < LZ_NUM_CODED && n > 0) {
+            size_t codedCap = HUFF_HEADER_SIZE + HUFF_JUMP_SIZE + HUFF_NUM_STREAMS * HUFF_BOUND(n / HUFF_NUM_STREAMS + 1);
+            coded = (u8*) malloc(codedCap);
+            ASSERT(coded, "Error: Out of memory in lzWriteStreams.\n");
+            size = huffBlockEncode(s->bufs[i], n, coded, codedCap);
+            if (size >= n) {
+                size = n;
+            }
+        }
+        pos += writeVarint(out + pos, n);
+        pos += writeVarint(out + pos, size);
+        memcpy(out + pos, size < n ? coded : s->bufs[i], size);
+        pos += size;
+        free(coded);
+    }
+    return pos;
+}
+
+
+/*
+ *  Optimal parse LZ77 (slow, high ratio level)
+ *
+ *  Same block format and decoder as the fast level. A binary tree match finder
+ *  reports a match for every length it finds at each position, and a forward dynamic
+ *  program picks the cheapest path through literals and matches by estimated bits.
+ *  The trees keep every position of the window sorted, so they also find matches
+ *  hash chains miss.
+ *
+ *  Costs start from the block's literal counts and guesses for the rest, then follow
+ *  the counts of what has been emitted so far. Paths are worked out LZ_OPT_CHUNK
+ *  positions at a time, or up to a match of at least LZ_OPT_NICE_LEN, which is taken
+ *  as is, and costs are updated in between.
+ */
+#define LZ_OPT_CHUNK 4096
+#define LZ_OPT_NICE_LEN 256
+#define LZ_OPT_DEFAULT_DEPTH 64
+// Sequences to see before their statistics replace the first guesses
+#define LZ_OPT_MIN_STATS 256
+// Costs are in 1/LZ_PRICE_SCALE bits
+#define LZ_PRICE_SCALE 16
+
+typedef struct LzPrices {
+    uint32_t lits[256];
+    uint32_t litLens[256];
+    uint32_t matchLens[256];
+    uint32_t offCodes[32];
+    // Symbols seen so far in each coded stream, and how much of it has been counted
+    uint64_t counts[4][256];
+    size_t counted[4];
+} LzPrices;
+
+typedef struct LzTree {
+    // Positions plus one, 0 is empty
+    uint32_t* head;
+    // Left and right child of each window position
+    uint32_t* sons;
+    uint32_t windowMask;
+} LzTree;
+
+
+static void lzPricesFromCounts(uint32_t* prices, const uint64_t* counts, int nSyms) {
+    uint64_t total = 0;
+    for (int s=0; s < nSyms; s++) {
+        total += counts[s];
+    }
+    for (int s=0; s < nSyms; s++) {
+        // Unseen symbols still get a finite cost
+        prices[s] = (uint32_t) (LZ_PRICE_SCALE * log2((total + nSyms) / (counts[s] + 1.0)));
+    }
+}
+
+
+static void lzInitPrices(LzPrices* p, const u8* in, size_t n) {
+    memset(p, 0, sizeof(LzPrices));
+    uint64_t counts[256];
+    histogram(in, n, counts);
+    lzPricesFromCounts(p->lits, counts, 256);
+    for (int v=0; v < 256; v++) {
+        // Short lengths are the common ones
+        uint32_t bits = 2 + 2 * highBit32(v + 1);
+        p->litLens[v] = bits * LZ_PRICE_SCALE;
+        p->matchLens[v] = bits * LZ_PRICE_SCALE;
+    }
+    for (int c=0; c < 32; c++) {
+        p->offCodes[c] = 5 * LZ_PRICE_SCALE;
+    }
+}
+
+
+// Reprice from everything emitted so far, counting only what's new since last time
+static void lzUpdatePrices(LzPrices* p, const LzStreams* s) {
+    static const int streams[4] = {LZ_LITS, LZ_LIT_LENS, LZ_MATCH_LENS, LZ_OFF_CODES};
+    uint32_t* prices[4] = {p->lits, p->litLens, p->matchLens, p->offCodes};
+    static const int nSyms[4] = {256, 256, 256, 32};
+    uint64_t part[256];
+    for (int i=0; i < 4; i++) {
+        int stream = streams[i];
+        histogram(s->bufs[stream] + p->counted[i], s->lens[stream] - p->counted[i], part);
+        p->counted[i] = s->lens[stream];
+        for (int c=0; c < 256; c++) {
+            p->counts[i][c] += part[c];
+        }
+        lzPricesFromCounts(prices[i], p->counts[i], nSyms[i]);
+    }
+}
+
+
+static inline uint32_t lzLenPrice(const uint32_t* prices, size_t len) {
+    if (len < 255) {
+        return prices[len];
+    }
+    // The varint overflow is stored, 8 bits a byte
+    u8 varint[10];
+    return prices[255] + 8 * LZ_PRICE_SCALE * writeVarint(varint, len - 255);
+}
+
+
+static inline uint32_t lzMatchPrice(const LzPrices* p, size_t len, uint32_t offset) {
+    int code = highBit32(offset);
+    // Ends the sequence, so the next one's literal length is paid here
+    return lzLenPrice(p->matchLens, len - LZ_MIN_MATCH) + p->offCodes[code] + code * LZ_PRICE_SCALE + p->litLens[0];
+}
+
+
+static void lzAllocTree(LzTree* t, int windowLog) {
+    t->head = (uint32_t*) calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+    t->sons = (uint32_t*) malloc(((size_t) 2 << windowLog) * sizeof(uint32_t));
+    ASSERT(t->head && t->sons, "Error: Out of memory in lzAllocTree.\n");
+    t->windowMask = (1u << windowLog) - 1;
+}
+
+
+static void lzFreeTree(LzTree* t) {
+    free(t->head);
+    free(t->sons);
+}
+
+
+/*
+ *  Insert pos into its tree, collecting matches of increasing length on the way down
+ *  (if lens isn't NULL). limit caps match lengths. Returns the number of matches.
+ */
+static int lzTreeMatches(LzTree* t, const u8* in, size_t pos, size_t limit, int depth, uint32_t* lens, uint32_t* offsets) {
+    uint32_t h = lzHash4(in + pos);
+    uint32_t cur = t->head[h];
+    t->head[h] = (uint32_t) pos + 1;
+    uint32_t* pair = &t->sons[2 * (pos & t->windowMask)];
+    // Where the next smaller and larger subtrees hang
+    uint32_t* smaller = pair;
+    uint32_t* larger = pair + 1;
+    size_t lenSmaller = 0;
+    size_t lenLarger = 0;
+    size_t best = LZ_MIN_MATCH - 1;
+    int nMatches = 0;
+
+    while (1) {
+        if (cur == 0 || depth-- == 0 || pos - (cur - 1) > t->windowMask) {
+            *smaller = 0;
+            *larger = 0;
+            break;
+        }
+        size_t cand = cur - 1;
+        uint32_t* candPair = &t->sons[2 * (cand & t->windowMask)];
+        size_t len = lenSmaller < lenLarger ? lenSmaller : lenLarger;
+        len += lzMatchLen(in + cand + len, in + pos + len, limit - len);
+        if (len > best) {
+            best = len;
+            if (lens) {
+                lens[nMatches] = (uint32_t) len;
+                offsets[nMatches++] = (uint32_t) (pos - cand);
+            }
+        }
+        if (len == limit) {
+            // Can't tell which side pos goes, so it takes over cand's children
+            *smaller = candPair[0];
+            *larger = candPair[1];
+            break;
+        }
+        if (in[cand + len] < in[pos + len]) {
+            *smaller = cur;
+            smaller = candPair + 1;
+            cur = *smaller;
+            lenSmaller = len;
+        } else {
+            *larger = cur;
+            larger = candPair;
+            cur = *larger;
+            lenLarger = len;
+        }
+    }
+    return nMatches;
+}
+
+
+// Emit the cheapest path from start to end, worked out backwards from end
+static void lzEmitPath(LzStreams* s, const u8* in, size_t start, size_t end, size_t* anchor, const uint32_t* fromLen, const uint32_t* fromOffset, uint32_t* path) {
+    size_t nSteps = 0;
+    for (size_t i=end; i > start; ) {
+        path[nSteps++] = (uint32_t) (i - start);
+        i -= fromLen[i - start] ? fromLen[i - start] : 1;
+    }
+    while (nSteps > 0) {
+        size_t i = start + path[--nSteps];
+        size_t len = fromLen[i - start];
+        if (len) {
+            size_t matchPos = i - len;
+            lzPutSeq(s, in + *anchor, matchPos - *anchor, len, fromOffset[i - start]);
+            *anchor = i;
+        }
+    }
+}
+
+
+static void lzParseOptimal(const u8* in, size_t n, const LzParams* params, LzStreams* s) {
+    LzPrices* prices = (LzPrices*) malloc(sizeof(LzPrices));
+    ASSERT(prices, "Error: Out of memory in lzParseOptimal.\n");
+    lzInitPrices(prices, in, n);
+    LzTree t;
+    lzAllocTree(&t, params->windowLog);
+    uint64_t* cost = (uint64_t*) malloc((LZ_OPT_CHUNK + 1) * sizeof(uint64_t));
+    uint32_t* run = (uint32_t*) malloc((LZ_OPT_CHUNK + 1) * sizeof(uint32_t));
+    uint32_t* fromLen = (uint32_t*) malloc((LZ_OPT_CHUNK + 1) * sizeof(uint32_t));
+    uint32_t* fromOffset = (uint32_t*) malloc((LZ_OPT_CHUNK + 1) * sizeof(uint32_t));
+    uint32_t* path = (uint32_t*) malloc((LZ_OPT_CHUNK + 1) * sizeof(uint32_t));
+    uint32_t lens[LZ_OPT_NICE_LEN];
+    uint32_t offsets[LZ_OPT_NICE_LEN];
+    ASSERT(cost && run && fromLen && fromOffset && path, "Error: Out of memory in lzParseOptimal.\n");
+
+    size_t anchor = 0;
+    // Positions with 4 bytes left to hash
+    size_t hashEnd = n >= LZ_MIN_MATCH ? n - LZ_MIN_MATCH + 1 : 0;
+    size_t start = 0;
+    while (start < n) {
+        size_t end = n - start < LZ_OPT_CHUNK ? n : start + LZ_OPT_CHUNK;
+        // Every cost includes its pending literal run's price, so the steps below never go negative
+        run[0] = (uint32_t) (start - anchor);
+        cost[0] = lzLenPrice(prices->litLens, run[0]);
+        fromLen[0] = 0;
+        for (size_t j=1; j <= end - start; j++) {
+            cost[j] = UINT64_MAX;
+        }
+
+        size_t niceLen = 0;
+        uint32_t niceOffset = 0;
+        for (size_t i=start; i < end; i++) {
+            size_t j = i - start;
+            // Literal
+            uint32_t r = run[j];
+            uint64_t c = cost[j] + prices->lits[in[i]] + lzLenPrice(prices->litLens, r + 1) - lzLenPrice(prices->litLens, r);
+            if (c < cost[j + 1]) {
+                cost[j + 1] = c;
+                run[j + 1] = r + 1;
+                fromLen[j + 1] = 0;
+            }
+            if (i >= hashEnd) {
+                continue;
+            }
+
+            size_t limit = n - i < LZ_OPT_NICE_LEN ? n - i : LZ_OPT_NICE_LEN;
+            int nMatches = lzTreeMatches(&t, in, i, limit, params->depth, lens, offsets);
+            if (nMatches > 0 && lens[nMatches - 1] >= LZ_OPT_NICE_LEN) {
+                // Long enough to take without weighing it up
+                niceLen = lens[nMatches - 1];
+                niceOffset = offsets[nMatches - 1];
+                end = i;
+                break;
+            }
+            size_t prevLen = LZ_MIN_MATCH - 1;
+            for (int k=0; k < nMatches; k++) {
+                size_t maxLen = lens[k] < end - i ? lens[k] : end - i;
+                for (size_t len=prevLen + 1; len <= maxLen; len++) {
+                    uint64_t mc = cost[j] + lzMatchPrice(prices, len, offsets[k]);
+                    if (mc < cost[j + len]) {
+                        cost[j + len] = mc;
+                        run[j + len] = 0;
+                        fromLen[j + len] = (uint32_t) len;
+                        fromOffset[j + len] = offsets[k];
+                    }
+                }
+                prevLen = lens[k];
+            }
+        }
+
+        lzEmitPath(s, in, start, end, &anchor, fromLen, fromOffset, path);
+        if (s->lens[LZ_LIT_LENS] >= LZ_OPT_MIN_STATS) {
+            lzUpdatePrices(prices, s);
+        }
+        start = end;
+        if (niceLen) {
+            // Carry on past the tree's length limit, then put the rest of it in the tree
+            niceLen += lzMatchLen(in + start + niceLen - niceOffset, in + start + niceLen, n - start - niceLen);
+            lzPutSeq(s, in + anchor, start - anchor, niceLen, niceOffset);
+            for (size_t i=start + 1; i < start + niceLen && i < hashEnd; i++) {
+                size_t limit = n - i < LZ_OPT_NICE_LEN ? n - i : LZ_OPT_NICE_LEN;
+                lzTreeMatches(&t, in, i, limit, params->depth, NULL, NULL);
+            }
+            start += niceLen;
+            anchor = start;
+        }
+    }
+    if (anchor < n) {
+        lzPutSeq(s, in + anchor, n - anchor, 0, 0);
+    }
+
+    free(path);
+    free(fromOffset);
+    free(fromLen);
+    free(run);
+    free(cost);
+    free(prices);
+    lzFreeTree(&t);
+}
+
+
+size_t lzEncode(const u8* in, size_t n, u8* out, size_t cap) {
+    LzParams params;
+    lzParamsFromEnv(&params, LZ_DEFAULT_DEPTH);
+    LzStreams s;
+    lzAllocStreams(&s, n);
+    lzParseLazy(in, n, &params, &s);
+    size_t size = lzWriteStreams(&s, out, cap);
+    lzFreeStreams(&s);
+    return size;
+}
+
+
+size_t lzOptEncode(const u8* in, size_t n, u8* out, size_t cap) {
+    LzParams params;
+    lzParamsFromEnv(&params, LZ_OPT_DEFAULT_DEPTH);
+    LzStreams s;
+    lzAllocStreams(&s, n);
+    lzParseOptimal(in, n, &params, &s);
+    size_t size = lzWriteStreams(&s, out, cap);
+    lzFreeStreams(&s);
+    return size;
+}
+
+
+static inline size_t lzGetLen(const u8** p, const u8** extra, const u8* extraEnd) {
+    size_t len = *(*p)++;
+    if (len == 255) {
+        len += readVarint(extra, extraEnd);
+    }
+    return len;
+}
+
+
+// Copy len bytes from offset back, where the two can overlap
+static inline void lzCopyMatch(u8* op, size_t offset, size_t len) {
+    const u8* src = op - offset;
+    if (offset >= 16) {
+        // Each 16 bytes read is already written, the last copy can run over
+        memcpy(op, src, 16);
+        memcpy(op + 16, src + 16, 16);
+        for (size_t i=32; i < len; i += 16) {
+            memcpy(op + i, src + i, 16);
+        }
+        return;
+    }
+    // The copied part repeats with period offset, so the step can double each time
+    size_t step = offset;
+    while (len > step) {
+        memcpy(op, src, step);
+        op += step;
+        len -= step;
+        step *= 2;
+    }
+    memcpy(op, src, len);
+}
+
+
+void lzDecode(const u8* in, size_t size, u8* out, size_t n) {
+    const u8* p = in;
+    const u8* end = in + size;
+    u8* streams[LZ_NUM_STREAMS];
+    size_t lens[LZ_NUM_STREAMS];
+    for (int i=0; i < LZ_NUM_STREAMS; i++) {
+        lens[i] = readVarint(&p, end);
+        size_t coded = readVarint(&p, end);
+        ASSERT(coded <= (size_t) (end - p) && coded <= lens[i] && lens[i] <= 2 * (size_t) LZ_BLOCK_SIZE, "Error in lzDecode: Corrupt stream sizes.\n");
+        streams[i] = (u8*) malloc(lens[i] + LZ_SLACK);
+        ASSERT(streams[i], "Error: Out of memory in lzDecode.\n");
+        if (coded == lens[i]) {
+            memcpy(streams[i], p, coded);
+        } else {
+            huffBlockDecode(p, coded, streams[i], lens[i]);
+        }
+        memset(streams[i] + lens[i], 0, LZ_SLACK);
+        p += coded;
+    }
+
+    const u8* lits = streams[LZ_LITS];
+    const u8* litsEnd = lits + lens[LZ_LITS];
+    const u8* litLens = streams[LZ_LIT_LENS];
+    const u8* matchLens = streams[LZ_MATCH_LENS];
+    const u8* offCodes = streams[LZ_OFF_CODES];
+    const u8* extra = streams[LZ_LEN_EXTRA];
+    const u8* extraEnd = extra + lens[LZ_LEN_EXTRA];
+    const u8* litLensEnd = litLens + lens[LZ_LIT_LENS];
+    const u8* matchLensEnd = matchLens + lens[LZ_MATCH_LENS];
+    BitStream bits;
+    bsReaderFromBuffer(&bits, streams[LZ_OFF_BITS], lens[LZ_OFF_BITS]);
+
+    u8* op = out;
+    u8* oend = out + n;
+    while (op < oend) {
+        ASSERT(litLens < litLensEnd, "Error in lzDecode: Ran out of sequences.\n");
+        size_t litLen = lzGetLen(&litLens, &extra, extraEnd);
+        ASSERT(litLen <= (size_t) (litsEnd - lits) && litLen <= (size_t) (oend - op), "Error in lzDecode: Corrupt literal length.\n");
+        // Wide copy, the stream and block buffers have slack for the overrun
+        memcpy(op, lits, 16);
+        for (size_t i=16; i < litLen; i += 16) {
+            memcpy(op + i, lits + i, 16);
+        }
+        op += litLen;
+        lits += litLen;
+        if (op == oend) {
+            break;
+        }
+
+        ASSERT(matchLens < matchLensEnd, "Error in lzDecode: Ran out of matches.\n");
+        size_t matchLen = lzGetLen(&matchLens, &extra, extraEnd) + LZ_MIN_MATCH;
+        int code = *offCodes++;
+        ASSERT(code < 32, "Error in lzDecode: Corrupt offset code.\n");
+        bsRefillFast(&bits);
+        size_t offset = ((size_t) 1 << code) | bsReadBits0(&bits, code);
+        ASSERT(offset <= (size_t) (op - out) && matchLen <= (size_t) (oend - op), "Error in lzDecode: Corrupt match.\n");
+        lzCopyMatch(op, offset, matchLen);
+        op += matchLen;
+    }
+
+    for (int i=0; i < LZ_NUM_STREAMS; i++) {
+        free(streams[i]);
+    }
+}
+
+
+const BlockCodec lzBlockCodec = {
+    lzEncode,
+    lzDecode,
+    LZ_BLOCK_SIZE,
+    LZ_BOUND(LZ_BLOCK_SIZE),
+    LZ_SLACK
+};
+
+
+// Only the encoder differs, either codec decodes both
+const BlockCodec lzOptBlockCodec = {
+    lzOptEncode,
+    lzDecode,
+    LZ_BLOCK_SIZE,
+    LZ_BOUND(LZ_BLOCK_SIZE),
+    LZ_SLACK
+};
+
+
+void lzCompress(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &lzBlockCodec);
+}
+
+
+void lzOptCompress(FILE* infp, FILE* outfp) {
+    blockCompress(infp, outfp, &lzOptBlockCodec);
+}
+
+
+void lzDecompress(FILE* infp, FILE* outfp) {
+    blockDecompress(infp, outfp, &lzBlockCodec);
+}
+
+
+/*
+ *  Long range deduplication
+ *
+ *  The input is cut into content defined chunks: a gear hash of the last 64 bytes is
+ *  checked at each position and a chunk ends where its top DEDUP_MASK_BITS bits are
+ *  all 0 (about every 8 KiB, between DEDUP_MIN_CHUNK and DEDUP_MAX_CHUNK). Since
+ *  the cut points depend only on nearby bytes, repeated data gets cut the same way
+ *  wherever it is. Each chunk gets a 128 bit fingerprint, and chunks seen before are
+ *  replaced with a reference back to the earlier copy. Runs far beyond any LZ window.
+ *
+ *  Chunks are found and fingerprinted in parallel over DEDUP_SEGMENT sized pieces,
+ *  which also always end a chunk. The fingerprint index is a set associative table
+ *  of at most COMP_DEDUP_MEM MiB (default 64), replacing the oldest chunk of a set
+ *  when it's full. The decoder keeps what it has written in a temp file to copy
+ *  references from.
+ *
+ *  NOTE: Chunks are matched by fingerprint alone, a 128 bit collision would corrupt
+ *  the output
+ *
+ *  Format: records of a varint (length << 1 | isRef), then either the literal bytes
+ *  or a varint distance back to the start of the earlier copy.
+ */
+#define DEDUP_MIN_CHUNK (1 << 11)
+#define DEDUP_MAX_CHUNK (1 << 16)
+#define DEDUP_MASK_BITS 13
+#define DEDUP_SEGMENT (1 << 22)
+#define DEDUP_BUF_SIZE (16 * DEDUP_SEGMENT)
+#define DEDUP_DEFAULT_MEM_MB 64
+#define DEDUP_WAYS 4
+
+typedef struct DedupEntry {
+    uint64_t fp[2];
+    uint64_t offset;
+    uint32_t len;
+    uint32_t used;
+} DedupEntry;
+
+typedef struct DedupIndex {
+    DedupEntry* entries;
+    size_t setMask;
+} DedupIndex;
+
+typedef struct DedupChunks {
+    const u8* buf;
+    size_t n;
+    // Chunk ends (relative to the segment start) and fingerprints of each segment
+    uint32_t* ends[DEDUP_BUF_SIZE / DEDUP_SEGMENT];
+    uint64_t* fps[DEDUP_BUF_SIZE / DEDUP_SEGMENT];
+    int counts[DEDUP_BUF_SIZE / DEDUP_SEGMENT];
+} DedupChunks;
+
+static uint64_t dedupGear[256];
+
+
+static void dedupInitGear(void) {
+    static int done = 0;
+    if (done) {
+        return;
+    }
+    // splitmix64, fixed seed so every run cuts the same way
+    uint64_t x = 0x5DEECE66Dull;
+    for (int i=0; i < 256; i++) {
+        x += 0x9E3779B97F4A7C15ull;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        dedupGear[i] = z ^ (z >> 31);
+    }
+    done = 1;
+}
+
+
+// Length of the chunk starting at p, out of n bytes left
+static inline size_t dedupCut(const u8* p, size_t n) {
+    if (n <= DEDUP_MIN_CHUNK) {
+        return n;
+    }
+    size_t end = n < DEDUP_MAX_CHUNK ? n : DEDUP_MAX_CHUNK;
+    const uint64_t mask = ((1ull << DEDUP_MASK_BITS) - 1) << (64 - DEDUP_MASK_BITS);
+    // The hash only depends on the last 64 bytes, so it can start just short of the minimum
+    uint64_t h = 0;
+    for (size_t i=DEDUP_MIN_CHUNK - 64; i < DEDUP_MIN_CHUNK; i++) {
+        h = (h << 1) + dedupGear[p[i]];
+    }
+    for (size_t i=DEDUP_MIN_CHUNK; i < end; i++) {
+        h = (h << 1) + dedupGear[p[i]];
+        if (!(h & mask)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+
+// Two independent 64 bit lanes (xxHash style rounds)
+static void dedupFingerprint(const u8* p, size_t n, uint64_t* fp) {
+    uint64_t a = 0x9E3779B185EBCA87ull ^ n;
+    uint64_t b = 0xC2B2AE3D27D4EB4Full + n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        a = rotl64(a + v * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+        b = rotl64(b ^ (v * 0x165667B19E3779F9ull), 27) * 0x85EBCA77C2B2AE63ull + 0x27D4EB2F165667C5ull;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p + i, n - i);
+    a = rotl64(a + tail * 0xC2B2AE3D27D4EB4Full, 31) * 0x9E3779B185EBCA87ull;
+    b = rotl64(b ^ (tail * 0x165667B19E3779F9ull), 27) * 0x85EBCA77C2B2AE63ull;
+    a ^= a >> 33;
+    a *= 0xFF51AFD7ED558CCDull;
+    a ^= a >> 33;
+    b ^= b >> 29;
+    b *= 0xC4CEB9FE1A85EC53ull;
+    b ^= b >> 32;
+    fp[0] = a;
+    fp[1] = b;
+}
+
+
+static void dedupChunkJob(void* ctx, int job) {
+    DedupChunks* c = (DedupChunks*) ctx;
+    size_t start = (size_t) job * DEDUP_SEGMENT;
+    size_t n = c->n - start < DEDUP_SEGMENT ? c->n - start : DEDUP_SEGMENT;
+    const u8* p = c->buf + start;
+    int count = 0;
+    size_t pos = 0;
+    while (pos < n) {
+        size_t len = dedupCut(p + pos, n - pos);
+        dedupFingerprint(p + pos, len, c->fps[job] + 2 * count);
+        pos += len;
+        c->ends[job][count++] = (uint32_t) pos;
+    }
+    c->counts[job] = count;
+}
+
+
+static void dedupInitIndex(DedupIndex* index) {
+    char* env = getenv("COMP_DEDUP_MEM");
+    size_t mem = (size_t) (env ? atol(env) : DEDUP_DEFAULT_MEM_MB) << 20;
+    size_t nSets = 1;
+    while (2 * nSets * DEDUP_WAYS * sizeof(DedupEntry) <= mem) {
+        nSets *= 2;
+    }
+    index->entries = (DedupEntry*) calloc(nSets * DEDUP_WAYS, sizeof(DedupEntry));
+    ASSERT(index->entries, "Error: Out of memory in dedupInitIndex.\n");
+    index->setMask = nSets - 1;
+}
+
+
+// Earlier chunk with this fingerprint, or NULL after adding this one
+static const DedupEntry* dedupLookup(DedupIndex* index, const uint64_t* fp, uint64_t offset, uint32_t len) {
+    DedupEntry* set = index->entries + (fp[0] & index->setMask) * DEDUP_WAYS;
+    DedupEntry* oldest = set;
+    for (int i=0; i < DEDUP_WAYS; i++) {
+        if (set[i].used && set[i].fp[0] == fp[0] && set[i].fp[1] == fp[1] && set[i].len == len) {
+            return &set[i];
+        }
+        if (!set[i].used || (oldest->used && set[i].offset < oldest->offset)) {
+            oldest = &set[i];
+        }
+    }
+    oldest->fp[0] = fp[0];
+    oldest->fp[1] = fp[1];
+    oldest->offset = offset;
+    oldest->len = len;
+    oldest->used = 1;
+    return NULL;
+}
+
+
+static void dedupWriteLiterals(FILE* outfp, const u8* p, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    u8 varint[10];
+    fwrite(varint, 1, writeVarint(varint, (uint64_t) len << 1), outfp);
+    fwrite(p, 1, len, outfp);
+}
+
+
+void dedupTransform(FILE* infp, FILE* outfp) {
+    dedupInitGear();
+    DedupIndex index;
+    dedupInitIndex(&index);
+    u8* buf = (u8*) malloc(DEDUP_BUF_SIZE);
+    DedupChunks c;
+    c.buf = buf;
+    int nSegs = DEDUP_BUF_SIZE / DEDUP_SEGMENT;
+    for (int s=0; s < nSegs; s++) {
+        c.ends[s] = (uint32_t*) malloc((DEDUP_SEGMENT / DEDUP_MIN_CHUNK + 1) * sizeof(uint32_t));
+        c.fps[s] = (uint64_t*) malloc((DEDUP_SEGMENT / DEDUP_MIN_CHUNK + 1) * 2 * sizeof(uint64_t));
+        ASSERT(c.ends[s] && c.fps[s], "Error: Out of memory in dedupTransform.\n");
+    }
+    ASSERT(buf, "Error: Out of memory in dedupTransform.\n");
+
+    uint64_t streamPos = 0;
+    size_t n;
+    while ((n = fread(buf, 1, DEDUP_BUF_SIZE, infp)) > 0) {
+        c.n = n;
+        int nJobs = (int) ((n + DEDUP_SEGMENT - 1) / DEDUP_SEGMENT);
+        parallelFor(nJobs, dedupChunkJob, &c);
+
+        // Literal chunks are gathered into runs between references
+        size_t litStart = 0;
+        for (int s=0; s < nJobs; s++) {
+            size_t chunkStart = (size_t) s * DEDUP_SEGMENT;
+            for (int i=0; i < c.counts[s]; i++) {
+                size_t chunkEnd = (size_t) s * DEDUP_SEGMENT + c.ends[s][i];
+                uint32_t len = (uint32_t) (chunkEnd - chunkStart);
+                const DedupEntry* e = dedupLookup(&index, c.fps[s] + 2 * i, streamPos + chunkStart, len);
+                if (e) {
+                    dedupWriteLiterals(outfp, buf + litStart, chunkStart - litStart);
+                    u8 varint[20];
+                    size_t size = writeVarint(varint, ((uint64_t) len << 1) | 1);
+                    size += writeVarint(varint + size, streamPos + chunkStart - e->offset);
+                    fwrite(varint, 1, size, outfp);
+                    litStart = chunkEnd;
+                }
+                chunkStart = chunkEnd;
+            }
+        }
+        dedupWriteLiterals(outfp, buf + litStart, n - litStart);
+        streamPos += n;
+    }
+
+    for (int s=0; s < nSegs; s++) {
+        free(c.ends[s]);
+        free(c.fps[s]);
+    }
+    free(buf);
+    free(index.entries);
+}
+
+
+void invDedupTransform(FILE* infp, FILE* outfp) {
+    // Everything written so far, to copy references from
+    FILE* history = tmpfile();
+    ASSERT(history, "Error creating temp file in invDedupTransform\n");
+    u8* buf = (u8*) malloc(DEDUP_BUF_SIZE);
+    ASSERT(buf, "Error: Out of memory in invDedupTransform.\n");
+    uint64_t streamPos = 0;
+
+    ByteReader br;
+    brOpen(&br, infp);
+    const u8* span;
+    while (brSpan(&br, &span) > 0) {
+        uint64_t tag = brVarint(&br);
+        uint64_t len = tag >> 1;
+        if (tag & 1) {
+            uint64_t dist = brVarint(&br);
+            ASSERT(dist > 0 && dist <= streamPos && len <= DEDUP_MAX_CHUNK, "Error in invDedupTransform: Corrupt reference.\n");
+            fflush(history);
+            ASSERT(fseek(history, (long) (streamPos - dist), SEEK_SET) == 0, "Error in invDedupTransform: Can't seek history.\n");
+            ASSERT(fread(buf, 1, len, history) == len, "Error in invDedupTransform: Reference past the end of history.\n");
+            fseek(history, 0, SEEK_END);
+            fwrite(buf, 1, len, outfp);
+            fwrite(buf, 1, len, history);
+            streamPos += len;
+            continue;
+        }
+        while (len > 0) {
+            size_t part = len < DEDUP_BUF_SIZE ? len : DEDUP_BUF_SIZE;
+            ASSERT(brRead(&br, buf, part) == part, "Error in invDedupTransform: Unexpected end of file in literals.\n");
+            fwrite(buf, 1, part, outfp);
+            fwrite(buf, 1, part, history);
+            streamPos += part;
+            len -= part;
+        }
+    }
+
+    brClose(&br);
+    free(buf);
+    fclose(history);
+}
+
+
+/*
+ *  Move to front
+ *
+ *  Each byte is replaced by its rank in a table of recently seen bytes, then moved to
+ *  the front. The table is a u8[256] so it fits in four cache lines; ranks are found
+ *  16 at a time with SSE2 and the shift is a memmove. After a BWT most ranks are 0,
+ *  which is checked before anything else.
+ *
+ *  MTF-1 only moves a byte to the front from rank 1, anything further back goes to
+ *  rank 1. Runs of one byte interrupted by another keep their rank 0 this way.
+ */
+#define MTF_BUF_SIZE (1 << 20)
+
+static inline int mtfRank(const u8* table, u8 c) {
+#ifdef __SSE2__
+    __m128i key = _mm_set1_epi8((char) c);
+    for (int i=0; i < 256; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (table + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, key));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return 255;
+#else
+    int i = 0;
+    while (table[i] != c) {
+        i++;
+    }
+    return i;
+#endif
+}
+
+
+void mtfInitTable(u8* table) {
+    for (int i=0; i < 256; i++) {
+        table[i] = (u8) i;
+    }
+}
+
+
+// The table carries over between calls so a stream can be done a buffer at a time
+void mtfEncodeBuf(u8* table, const u8* in, u8* out, size_t n) {
+    for (size_t i=0; i < n; i++) {
+        u8 c = in[i];
+        if (table[0] == c) {
+            out[i] = 0;
+            continue;
+        }
+        int rank = mtfRank(table, c);
+        memmove(table + 1, table, rank);
+        table[0] = c;
+        out[i] = (u8) rank;
+    }
+}
+
+
+void mtfDecodeBuf(u8* table, const u8* in, u8* out, size_t n) {
+    for (size_t i=0; i < n; i++) {
+        int rank = in[i];
+        u8 c = table[rank];
+        memmove(table + 1, table, rank);
+        table[0] = c;
+        out[i] = c;
+    }
+}
+
+
+void mtf1EncodeBuf(u8* table, const u8* in, u8* out, size_t n) {
+    for (size_t i=0; i < n; i++) {
+        u8 c = in[i];
+        if (table[0] == c) {
+            out[i] = 0;
+            continue;
+        }
+        int rank = mtfRank(table, c);
+        if (rank == 1) {
+            table[1] = table[0];
+            table[0] = c;
+        } else {
+            memmove(table + 2, table + 1, rank - 1);
+            table[1] = c;
+        }
+        out[i] = (u8) rank;
+    }
+}
+
+
+void mtf1DecodeBuf(u8* table, const u8* in, u8* out, size_t n) {
+    for (size_t i=0; i < n; i++) {
+        int rank = in[i];
+        u8 c = table[rank];
+        if (rank == 1) {
+            table[1] = table[0];
+            table[0] = c;
+        } else if (rank > 1) {
+            memmove(table + 2, table + 1, rank - 1);
+            table[1] = c;
+        }
+        out[i] = c;
+    }
+}
+
+
+typedef void (*MtfBufPtr)(u8* table, const u8* in, u8* out, size_t n);
+
+static void mtfStream(FILE* infp, FILE* outfp, MtfBufPtr fn) {
+    u8 table[256];
+    mtfInitTable(table);
+    u8* in = (u8*) malloc(MTF_BUF_SIZE);
+    u8* out = (u8*) malloc(MTF_BUF_SIZE);
+    ASSERT(in && out, "Error: Out of memory in mtfStream.\n");
+    size_t n;
+    while ((n = fread(in, 1, MTF_BUF_SIZE, infp)) > 0) {
+        fn(table, in, out, n);
+        fwrite(out, 1, n, outfp);
+    }
+    free(out);
+    free(in);
+}
+
+
+void moveToFrontTransform(FILE* infp, FILE* outfp) {
+    mtfStream(infp, outfp, mtfEncodeBuf);
+}
+
+
+void invMoveToFrontTransform(FILE* infp, FILE* outfp) {
+    mtfStream(infp, outfp, mtfDecodeBuf);
+}
+
+
+void mtf1Transform(FILE* infp, FILE* outfp) {
+    mtfStream(infp, outfp, mtf1EncodeBuf);
+}
+
+
+void invMtf1Transform(FILE* infp, FILE* outfp) {
+    mtfStream(infp, outfp, mtf1DecodeBuf);
+}
+
+
+/*
+ *  Lossy image quantisation
+ *
+ *  Each byte becomes its nearest multiple of the factor (rounding down near 255 so
+ *  it still fits), stored divided by the factor. The factor comes from
+ *  COMP_IMG_QUANT and is written after the BMP header for the inverse.
+ */
+int imgQuantFacFromEnv(void) {
+    char* env = getenv("COMP_IMG_QUANT");
+    int fac = env ? atoi(env) : IMG_QUANT_DEFAULT_FAC;
+    if (fac < 2) {
+        fac = 2;
+    }
+    if (fac > 255) {
+        fac = 255;
+    }
+    return fac;
+}
+
+
+void imgQuantBuf(const u8* in, u8* out, size_t n, int fac) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // c / fac is (c * recip) >> 16 for any byte c
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i recip = _mm_set1_epi16(65536 / fac + 1);
+    const __m128i facs = _mm_set1_epi16(fac);
+    const __m128i halfMinus1 = _mm_set1_epi16(fac / 2 - 1);
+    const __m128i topPlus1 = _mm_set1_epi16(257 - fac);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i halves[2] = {_mm_unpacklo_epi8(x, zero), _mm_unpackhi_epi8(x, zero)};
+        for (int k=0; k < 2; k++) {
+            __m128i c = halves[k];
+            __m128i q = _mm_mulhi_epu16(c, recip);
+            __m128i r = _mm_sub_epi16(c, _mm_mullo_epi16(q, facs));
+            __m128i roundUp = _mm_and_si128(_mm_cmpgt_epi16(r, halfMinus1), _mm_cmpgt_epi16(topPlus1, c));
+            halves[k] = _mm_sub_epi16(q, roundUp);
+        }
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#endif
+    for (; i < n; i++) {
+        int c = in[i];
+        if (c > 256 - fac || c % fac < fac / 2) {
+            out[i] = c / fac;
+        } else {
+            out[i] = c / fac + 1;
+        }
+    }
+}
+
+
+void imgDequantBuf(const u8* in, u8* out, size_t n, int fac) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i facs = _mm_set1_epi16(fac);
+    const __m128i lowByte = _mm_set1_epi16(0xff);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i lo = _mm_and_si128(_mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), facs), lowByte);
+        __m128i hi = _mm_and_si128(_mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), facs), lowByte);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i] * fac;
+    }
+}
+
+
+// Run a quantisation kernel over the pixel bytes of a BMP a band at a time
+static void imgQuantStream(FILE* infp, FILE* outfp, BMPFileHeader* h, int fac,
+                           void (*kernel)(const u8*, u8*, size_t, int)) {
+    size_t left = bmpNumRows(h) * h->width * (h->bitsPerPixel / 8);
+    u8* buf = (u8*) malloc(BMP_BAND_SIZE);
+    ASSERT(buf, "Error: Out of memory in imgQuantStream.\n");
+    while (left > 0) {
+        size_t n = left < BMP_BAND_SIZE ? left : BMP_BAND_SIZE;
+        size_t got = fread(buf, 1, n, infp);
+        ASSERT(got == n, "Error in imgQuantTransform: Unexpected end of file!\n");
+        kernel(buf, buf, n, fac);
+        fwrite(buf, 1, n, outfp);
+        left -= n;
+    }
+    free(buf);
+}
+
+
+void imgQuantTransform(FILE* infp, FILE* outfp) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    copyBMPHeader(infp, outfp, &h);
+
+    int fac = imgQuantFacFromEnv();
+    fputc(fac, outfp);
+    imgQuantStream(infp, outfp, &h, fac, imgQuantBuf);
+
+    copyRemaining(infp, outfp);
 }
 
 
@@ -618,289 +4216,2130 @@ void invImgQuantTransform(FILE* infp, FILE* outfp) {
     readBMPHeader(infp, &h);
     copyBMPHeader(infp, outfp, &h);
 
-    int fac = IMG_QUANT_FAC;
+    int fac = fgetc(infp);
+    ASSERT(fac >= 2 && fac != EOF, "Error in invImgQuantTransform: Bad quantisation factor.\n");
+    imgQuantStream(infp, outfp, &h, fac, imgDequantBuf);
+
+    copyRemaining(infp, outfp);
+}
+
+
+/*
+ *  Split a BMP image into separate colour channels
+ *
+ *  Works on bands of rows. Each band is written as its blue plane, then green, red
+ *  and for 32 bit images alpha, then the row padding bytes. Only a band of input and
+ *  output is held at once.
+ */
+#ifdef __SSE2__
+// 16 BGR pixels into 16 bytes of each channel
+static inline void rgbSplit16x3(const u8* px, u8* c0, u8* c1, u8* c2) {
+    __m128i t00 = _mm_loadu_si128((const __m128i*) px);
+    __m128i t01 = _mm_loadu_si128((const __m128i*) (px + 16));
+    __m128i t02 = _mm_loadu_si128((const __m128i*) (px + 32));
+
+    // Each round of unpacks moves every byte closer to its channel
+    __m128i t10 = _mm_unpacklo_epi8(t00, _mm_unpackhi_epi64(t01, t01));
+    __m128i t11 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t00, t00), t02);
+    __m128i t12 = _mm_unpacklo_epi8(t01, _mm_unpackhi_epi64(t02, t02));
+
+    __m128i t20 = _mm_unpacklo_epi8(t10, _mm_unpackhi_epi64(t11, t11));
+    __m128i t21 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t10, t10), t12);
+    __m128i t22 = _mm_unpacklo_epi8(t11, _mm_unpackhi_epi64(t12, t12));
+
+    __m128i t30 = _mm_unpacklo_epi8(t20, _mm_unpackhi_epi64(t21, t21));
+    __m128i t31 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t20, t20), t22);
+    __m128i t32 = _mm_unpacklo_epi8(t21, _mm_unpackhi_epi64(t22, t22));
+
+    _mm_storeu_si128((__m128i*) c0, _mm_unpacklo_epi8(t30, _mm_unpackhi_epi64(t31, t31)));
+    _mm_storeu_si128((__m128i*) c1, _mm_unpacklo_epi8(_mm_unpackhi_epi64(t30, t30), t32));
+    _mm_storeu_si128((__m128i*) c2, _mm_unpacklo_epi8(t31, _mm_unpackhi_epi64(t32, t32)));
+}
+
+
+// Inverse of rgbSplit16x3
+static inline void rgbMerge16x3(const u8* c0, const u8* c1, const u8* c2, u8* px) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i*) c0);
+    __m128i b = _mm_loadu_si128((const __m128i*) c1);
+    __m128i c = _mm_loadu_si128((const __m128i*) c2);
+
+    // Build 4 byte pixels with a zero fourth byte...
+    __m128i ab0 = _mm_unpacklo_epi8(a, b);
+    __m128i ab1 = _mm_unpackhi_epi8(a, b);
+    __m128i cz0 = _mm_unpacklo_epi8(c, zero);
+    __m128i cz1 = _mm_unpackhi_epi8(c, zero);
+    __m128i p00 = _mm_unpacklo_epi16(ab0, cz0);
+    __m128i p01 = _mm_unpackhi_epi16(ab0, cz0);
+    __m128i p02 = _mm_unpacklo_epi16(ab1, cz1);
+    __m128i p03 = _mm_unpackhi_epi16(ab1, cz1);
+
+    // ...then squeeze the zeros out
+    __m128i p10 = _mm_unpacklo_epi32(p00, p01);
+    __m128i p11 = _mm_unpackhi_epi32(p00, p01);
+    __m128i p12 = _mm_unpacklo_epi32(p02, p03);
+    __m128i p13 = _mm_unpackhi_epi32(p02, p03);
+
+    __m128i p20 = _mm_slli_si128(_mm_unpacklo_epi64(p10, p11), 1);
+    __m128i p21 = _mm_unpackhi_epi64(p10, p11);
+    __m128i p22 = _mm_slli_si128(_mm_unpacklo_epi64(p12, p13), 1);
+    __m128i p23 = _mm_unpackhi_epi64(p12, p13);
+
+    __m128i p30 = _mm_slli_epi64(_mm_unpacklo_epi32(p20, p21), 8);
+    __m128i p31 = _mm_srli_epi64(_mm_unpackhi_epi32(p20, p21), 8);
+    __m128i p32 = _mm_slli_epi64(_mm_unpacklo_epi32(p22, p23), 8);
+    __m128i p33 = _mm_srli_epi64(_mm_unpackhi_epi32(p22, p23), 8);
+
+    __m128i p40 = _mm_unpacklo_epi64(p30, p31);
+    __m128i p41 = _mm_unpackhi_epi64(p30, p31);
+    __m128i p42 = _mm_unpacklo_epi64(p32, p33);
+    __m128i p43 = _mm_unpackhi_epi64(p32, p33);
+
+    _mm_storeu_si128((__m128i*) px, _mm_or_si128(_mm_srli_si128(p40, 2), _mm_slli_si128(p41, 10)));
+    _mm_storeu_si128((__m128i*) (px + 16), _mm_or_si128(_mm_srli_si128(p41, 6), _mm_slli_si128(p42, 6)));
+    _mm_storeu_si128((__m128i*) (px + 32), _mm_or_si128(_mm_srli_si128(p42, 10), _mm_slli_si128(p43, 2)));
+}
+
+
+// 16 BGRA pixels into 16 bytes of each channel
+static inline void rgbSplit16x4(const u8* px, u8* c0, u8* c1, u8* c2, u8* c3) {
+    const __m128i lowByte = _mm_set1_epi32(0xff);
+    __m128i v[4];
+    for (int k=0; k < 4; k++) {
+        v[k] = _mm_loadu_si128((const __m128i*) (px + 16 * k));
+    }
+    u8* out[4] = {c0, c1, c2, c3};
+    for (int ch=0; ch < 4; ch++) {
+        __m128i lo = _mm_packs_epi32(_mm_and_si128(v[0], lowByte), _mm_and_si128(v[1], lowByte));
+        __m128i hi = _mm_packs_epi32(_mm_and_si128(v[2], lowByte), _mm_and_si128(v[3], lowByte));
+        _mm_storeu_si128((__m128i*) out[ch], _mm_packus_epi16(lo, hi));
+        for (int k=0; k < 4; k++) {
+            v[k] = _mm_srli_epi32(v[k], 8);
+        }
+    }
+}
+
+
+// Inverse of rgbSplit16x4
+static inline void rgbMerge16x4(const u8* c0, const u8* c1, const u8* c2, const u8* c3, u8* px) {
+    __m128i a = _mm_loadu_si128((const __m128i*) c0);
+    __m128i b = _mm_loadu_si128((const __m128i*) c1);
+    __m128i c = _mm_loadu_si128((const __m128i*) c2);
+    __m128i d = _mm_loadu_si128((const __m128i*) c3);
+    __m128i ab0 = _mm_unpacklo_epi8(a, b);
+    __m128i ab1 = _mm_unpackhi_epi8(a, b);
+    __m128i cd0 = _mm_unpacklo_epi8(c, d);
+    __m128i cd1 = _mm_unpackhi_epi8(c, d);
+    _mm_storeu_si128((__m128i*) px, _mm_unpacklo_epi16(ab0, cd0));
+    _mm_storeu_si128((__m128i*) (px + 16), _mm_unpackhi_epi16(ab0, cd0));
+    _mm_storeu_si128((__m128i*) (px + 32), _mm_unpacklo_epi16(ab1, cd1));
+    _mm_storeu_si128((__m128i*) (px + 48), _mm_unpackhi_epi16(ab1, cd1));
+}
+#endif
+
+
+// De-interleave width pixels of channels bytes into planes, planes[k] start at offset
+static void rgbSplitRow(const u8* px, size_t width, int channels, u8** planes, size_t offset) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (channels == 3) {
+        for (; i + 16 <= width; i += 16) {
+            rgbSplit16x3(px + 3 * i, planes[0] + offset + i, planes[1] + offset + i, planes[2] + offset + i);
+        }
+    } else {
+        for (; i + 16 <= width; i += 16) {
+            rgbSplit16x4(px + 4 * i, planes[0] + offset + i, planes[1] + offset + i,
+                         planes[2] + offset + i, planes[3] + offset + i);
+        }
+    }
+#endif
+    for (; i < width; i++) {
+        for (int ch=0; ch < channels; ch++) {
+            planes[ch][offset + i] = px[channels * i + ch];
+        }
+    }
+}
+
+
+static void rgbMergeRow(u8* const* planes, size_t offset, size_t width, int channels, u8* px) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (channels == 3) {
+        for (; i + 16 <= width; i += 16) {
+            rgbMerge16x3(planes[0] + offset + i, planes[1] + offset + i, planes[2] + offset + i, px + 3 * i);
+        }
+    } else {
+        for (; i + 16 <= width; i += 16) {
+            rgbMerge16x4(planes[0] + offset + i, planes[1] + offset + i, planes[2] + offset + i,
+                         planes[3] + offset + i, px + 4 * i);
+        }
+    }
+#endif
+    for (; i < width; i++) {
+        for (int ch=0; ch < channels; ch++) {
+            px[channels * i + ch] = planes[ch][offset + i];
+        }
+    }
+}
+
+
+static int rgbChannels(BMPFileHeader* h) {
+    ASSERT(h->bitsPerPixel == 24 || h->bitsPerPixel == 32, "Error in rgbTransform: Only 24 and 32 bits per pixel are supported.\n");
+    return h->bitsPerPixel / 8;
+}
+
+
+// Point planes at the channel planes and padding of a band of nRows
+static void rgbBandPlanes(u8* buf, size_t width, size_t nRows, int channels, u8** planes) {
+    for (int ch=0; ch <= channels; ch++) {
+        planes[ch] = buf + ch * width * nRows;
+    }
+}
+
+
+void rgbTransform(FILE* infp, FILE* outfp) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    int channels = rgbChannels(&h);
+    size_t width = h.width;
+    size_t rowBytes = bmpRowBytes(&h);
+    size_t pad = rowBytes - channels * width;
+    size_t rowsLeft = bmpNumRows(&h);
+    size_t bandRows = BMP_BAND_SIZE / (rowBytes + 1) + 1;
+
+    copyBMPHeader(infp, outfp, &h);
+
+    u8* in = (u8*) malloc(bandRows * rowBytes);
+    u8* out = (u8*) malloc(bandRows * rowBytes);
+    ASSERT(in && out, "Error: Out of memory in rgbTransform.\n");
+    u8* planes[5];
+
+    while (rowsLeft > 0) {
+        size_t nRows = rowsLeft < bandRows ? rowsLeft : bandRows;
+        size_t got = fread(in, 1, nRows * rowBytes, infp);
+        ASSERT(got == nRows * rowBytes, "Error in rgbTransform: Unexpected end of file in image data.\n");
+        rgbBandPlanes(out, width, nRows, channels, planes);
+        for (size_t r=0; r < nRows; r++) {
+            const u8* row = in + r * rowBytes;
+            rgbSplitRow(row, width, channels, planes, r * width);
+            memcpy(planes[channels] + r * pad, row + channels * width, pad);
+        }
+        fwrite(out, 1, nRows * rowBytes, outfp);
+        rowsLeft -= nRows;
+    }
+    free(out);
+    free(in);
+
+    // If there's anything else copy it over.
+    copyRemaining(infp, outfp);
+}
+
+
+void invRGBTransform(FILE *infp, FILE *outfp) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    int channels = rgbChannels(&h);
+    size_t width = h.width;
+    size_t rowBytes = bmpRowBytes(&h);
+    size_t pad = rowBytes - channels * width;
+    size_t rowsLeft = bmpNumRows(&h);
+    size_t bandRows = BMP_BAND_SIZE / (rowBytes + 1) + 1;
+
+    copyBMPHeader(infp, outfp, &h);
+
+    u8* in = (u8*) malloc(bandRows * rowBytes);
+    u8* out = (u8*) malloc(bandRows * rowBytes);
+    ASSERT(in && out, "Error: Out of memory in invRGBTransform.\n");
+    u8* planes[5];
+
+    while (rowsLeft > 0) {
+        size_t nRows = rowsLeft < bandRows ? rowsLeft : bandRows;
+        size_t got = fread(in, 1, nRows * rowBytes, infp);
+        ASSERT(got == nRows * rowBytes, "Error in invRGBTransform: Unexpected end of file in image data.\n");
+        rgbBandPlanes(in, width, nRows, channels, planes);
+        for (size_t r=0; r < nRows; r++) {
+            u8* row = out + r * rowBytes;
+            rgbMergeRow(planes, r * width, width, channels, row);
+            memcpy(row + channels * width, planes[channels] + r * pad, pad);
+        }
+        fwrite(out, 1, nRows * rowBytes, outfp);
+        rowsLeft -= nRows;
+    }
+    free(out);
+    free(in);
+
+    copyRemaining(infp, outfp);
+}
+
+
+/*
+ *  Reversible YCoCg-R colour transform
+ *
+ *  Pixels stay interleaved with Y, Co, Cg in place of B, G, R (alpha and row padding
+ *  are left alone), so the row filters and rgbTransform can still follow. The
+ *  lifting steps work on bytes with chroma taken as signed and wrapping, which keeps
+ *  every step exactly invertible without widening the planes.
+ */
+#ifdef __SSE2__
+// Arithmetic shift right by 1 of signed bytes
+static inline __m128i sra1Epi8(__m128i x) {
+    const __m128i low7 = _mm_set1_epi8(0x7f);
+    const __m128i sign = _mm_set1_epi8(0x40);
+    x = _mm_and_si128(_mm_srli_epi16(x, 1), low7);
+    return _mm_sub_epi8(_mm_xor_si128(x, sign), sign);
+}
+#endif
+
+
+// planes hold B, G, R on the way in and Y, Co, Cg on the way out
+void ycocgEncodeBuf(u8* b, u8* g, u8* r, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i bv = _mm_loadu_si128((const __m128i*) (b + i));
+        __m128i gv = _mm_loadu_si128((const __m128i*) (g + i));
+        __m128i rv = _mm_loadu_si128((const __m128i*) (r + i));
+        __m128i co = _mm_sub_epi8(rv, bv);
+        __m128i t = _mm_add_epi8(bv, sra1Epi8(co));
+        __m128i cg = _mm_sub_epi8(gv, t);
+        _mm_storeu_si128((__m128i*) (b + i), _mm_add_epi8(t, sra1Epi8(cg)));
+        _mm_storeu_si128((__m128i*) (g + i), co);
+        _mm_storeu_si128((__m128i*) (r + i), cg);
+    }
+#endif
+    for (; i < n; i++) {
+        int8_t co = r[i] - b[i];
+        u8 t = b[i] + (co >> 1);
+        int8_t cg = g[i] - t;
+        b[i] = t + (cg >> 1);
+        g[i] = co;
+        r[i] = cg;
+    }
+}
+
+
+void ycocgDecodeBuf(u8* y, u8* co, u8* cg, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i yv = _mm_loadu_si128((const __m128i*) (y + i));
+        __m128i cov = _mm_loadu_si128((const __m128i*) (co + i));
+        __m128i cgv = _mm_loadu_si128((const __m128i*) (cg + i));
+        __m128i t = _mm_sub_epi8(yv, sra1Epi8(cgv));
+        __m128i bv = _mm_sub_epi8(t, sra1Epi8(cov));
+        _mm_storeu_si128((__m128i*) (y + i), bv);
+        _mm_storeu_si128((__m128i*) (co + i), _mm_add_epi8(cgv, t));
+        _mm_storeu_si128((__m128i*) (cg + i), _mm_add_epi8(bv, cov));
+    }
+#endif
+    for (; i < n; i++) {
+        int8_t coi = co[i];
+        int8_t cgi = cg[i];
+        u8 t = y[i] - (cgi >> 1);
+        u8 b = t - (coi >> 1);
+        y[i] = b;
+        co[i] = cgi + t;
+        cg[i] = b + coi;
+    }
+}
+
+
+// Apply a YCoCg kernel to every pixel of a BMP a band of rows at a time
+static void ycocgStream(FILE* infp, FILE* outfp, void (*kernel)(u8*, u8*, u8*, size_t)) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    int channels = rgbChannels(&h);
+    size_t width = h.width;
+    size_t rowBytes = bmpRowBytes(&h);
+    size_t rowsLeft = bmpNumRows(&h);
+    size_t bandRows = BMP_BAND_SIZE / (rowBytes + 1) + 1;
+
+    copyBMPHeader(infp, outfp, &h);
+
+    u8* band = (u8*) malloc(bandRows * rowBytes);
+    // Channel planes of one row
+    u8* scratch = (u8*) malloc(4 * width + 1);
+    ASSERT(band && scratch, "Error: Out of memory in ycocgStream.\n");
+    u8* planes[4];
+    for (int ch=0; ch < 4; ch++) {
+        planes[ch] = scratch + ch * width;
+    }
+
+    while (rowsLeft > 0) {
+        size_t nRows = rowsLeft < bandRows ? rowsLeft : bandRows;
+        size_t got = fread(band, 1, nRows * rowBytes, infp);
+        ASSERT(got == nRows * rowBytes, "Error in ycocgTransform: Unexpected end of file in image data.\n");
+        for (size_t r=0; r < nRows; r++) {
+            u8* row = band + r * rowBytes;
+            rgbSplitRow(row, width, channels, planes, 0);
+            kernel(planes[0], planes[1], planes[2], width);
+            rgbMergeRow(planes, 0, width, channels, row);
+        }
+        fwrite(band, 1, nRows * rowBytes, outfp);
+        rowsLeft -= nRows;
+    }
+    free(scratch);
+    free(band);
+
+    copyRemaining(infp, outfp);
+}
+
+
+void ycocgTransform(FILE* infp, FILE* outfp) {
+    ycocgStream(infp, outfp, ycocgEncodeBuf);
+}
+
+
+void invYcocgTransform(FILE* infp, FILE* outfp) {
+    ycocgStream(infp, outfp, ycocgDecodeBuf);
+}
+
+
+/*
+ *  Relative (delta) encoding
+ *
+ *  Works a DELTA_BLOCK_SIZE block at a time in one pass, so it streams. Each block
+ *  starts with a mode byte: 0 stores it as is, a stride s stores each byte minus the
+ *  one s before it (the first s against 0). Stride 3 and 4 suit interleaved pixels.
+ *  The mode with the lowest order-0 entropy is picked per block.
+ *
+ *  Encoding is a vector subtract. Decoding is a prefix sum along each stride, done
+ *  16 bytes at a time with shifted adds.
+ */
+#define DELTA_BLOCK_SIZE (1 << 16)
+#define DELTA_NUM_STRIDES 5
+
+static const int deltaStrides[DELTA_NUM_STRIDES] = {1, 2, 3, 4, 8};
+
+
+void deltaEncodeBuf(const u8* in, u8* out, size_t n, int stride) {
+    size_t i = 0;
+    for (; i < n && i < (size_t) stride; i++) {
+        out[i] = in[i];
+    }
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i prev = _mm_loadu_si128((const __m128i*) (in + i - stride));
+        _mm_storeu_si128((__m128i*) (out + i), _mm_sub_epi8(cur, prev));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i] - in[i - stride];
+    }
+}
+
+
+#ifdef __SSE2__
+// Add each lane to the ones stride, 2 stride, 4 stride... after it
+static inline __m128i deltaPrefix16(__m128i x, int stride) {
+    switch (stride) {
+        case 1:
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        case 2:
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        case 3:
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+            return _mm_add_epi8(x, _mm_slli_si128(x, 12));
+        case 4:
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+        default:
+            return _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    }
+}
+#endif
+
+
+void deltaDecodeBuf(const u8* in, u8* out, size_t n, int stride) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (stride <= 8) {
+        for (; i < n && i < 16; i++) {
+            out[i] = in[i] + (i >= (size_t) stride ? out[i - stride] : 0);
+        }
+        // Only the first stride lanes take from the last output, the rest from the sum
+        u8 maskBytes[16] = {0};
+        memset(maskBytes, 0xff, stride);
+        const __m128i mask = _mm_loadu_si128((const __m128i*) maskBytes);
+        for (; i + 16 <= n; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+            __m128i carry = _mm_loadu_si128((const __m128i*) (out + i - stride));
+            x = _mm_add_epi8(x, _mm_and_si128(carry, mask));
+            _mm_storeu_si128((__m128i*) (out + i), deltaPrefix16(x, stride));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i] + (i >= (size_t) stride ? out[i - stride] : 0);
+    }
+}
+
+
+// Order-0 entropy of buf in bits
+static double deltaCost(const u8* buf, size_t n) {
+    uint64_t counts[256];
+    histogram(buf, n, counts);
+    double bits = n * log2((double) n);
+    for (int c=0; c < 256; c++) {
+        if (counts[c]) {
+            bits -= counts[c] * log2((double) counts[c]);
+        }
+    }
+    return bits;
+}
+
+
+void compRelative(FILE *infp, FILE *outfp) {
+    u8* in = (u8*) malloc(DELTA_BLOCK_SIZE);
+    u8* trial = (u8*) malloc(DELTA_BLOCK_SIZE);
+    u8* best = (u8*) malloc(DELTA_BLOCK_SIZE);
+    ASSERT(in && trial && best, "Error: Out of memory in compRelative.\n");
+    size_t n;
+    while ((n = fread(in, 1, DELTA_BLOCK_SIZE, infp)) > 0) {
+        int mode = 0;
+        double bestCost = deltaCost(in, n);
+        for (int k=0; k < DELTA_NUM_STRIDES; k++) {
+            deltaEncodeBuf(in, trial, n, deltaStrides[k]);
+            double cost = deltaCost(trial, n);
+            if (cost < bestCost) {
+                bestCost = cost;
+                mode = deltaStrides[k];
+                u8* swap = best;
+                best = trial;
+                trial = swap;
+            }
+        }
+        fputc(mode, outfp);
+        fwrite(mode ? best : in, 1, n, outfp);
+    }
+    free(best);
+    free(trial);
+    free(in);
+}
+
+
+// Raw or one of the strides the encoder tries
+static int deltaModeValid(int mode) {
+    if (mode == 0) {
+        return 1;
+    }
+    for (int k=0; k < DELTA_NUM_STRIDES; k++) {
+        if (deltaStrides[k] == mode) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void decompRelative(FILE *infp, FILE *outfp) {
+    u8* in = (u8*) malloc(DELTA_BLOCK_SIZE);
+    u8* out = (u8*) malloc(DELTA_BLOCK_SIZE);
+    ASSERT(in && out, "Error: Out of memory in decompRelative.\n");
+    int mode;
+    while ((mode = fgetc(infp)) != EOF) {
+        ASSERT(deltaModeValid(mode), "Error in decompRelative: Bad block mode.\n");
+        size_t n = fread(in, 1, DELTA_BLOCK_SIZE, infp);
+        ASSERT(n > 0, "Error in decompRelative: Block missing after mode.\n");
+        if (mode) {
+            deltaDecodeBuf(in, out, n, mode);
+        }
+        fwrite(mode ? out : in, 1, n, outfp);
+    }
+    free(out);
+    free(in);
+}
+
+
+/*
+ *  PNG style row filters for BMP pixel data
+ *
+ *  Each row (padding included) is replaced by its residual under one of the PNG
+ *  predictors and prefixed with the filter used. Left is the same channel of the
+ *  previous pixel and up the row before, both 0 off the edge. The row's filter is the
+ *  one with the smallest sum of absolute residuals. Rows go through BMP_BAND_SIZE
+ *  bands so memory does not grow with the image.
+ *
+ * Compression Ratios (followed by huffmanCompress):
+ * ==========================
+ * image.bmp                    0.99994
+ * image.bmp (w/ filters)       2.28931
+ */
+// Room past the end of a row for the 4 byte pixel loads
+#define BMP_ROW_SLACK 16
+
+enum {
+    BMP_FILTER_NONE,
+    BMP_FILTER_SUB,
+    BMP_FILTER_UP,
+    BMP_FILTER_AVG,
+    BMP_FILTER_PAETH,
+    BMP_NUM_FILTERS
+};
+
+
+static inline int paethPredict(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+
+#ifdef __SSE2__
+static inline __m128i absEpi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+
+// Paeth predictor on 8 16-bit lanes
+static inline __m128i paethPredict16(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = absEpi16(_mm_add_epi16(pa, pb));
+    pa = absEpi16(pa);
+    pb = absEpi16(pb);
+    __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+    __m128i useC = _mm_cmpgt_epi16(pb, pc);
+    __m128i bc = _mm_or_si128(_mm_and_si128(useC, c), _mm_andnot_si128(useC, b));
+    return _mm_or_si128(_mm_and_si128(notA, bc), _mm_andnot_si128(notA, a));
+}
+
+
+static inline __m128i loadPixel16(const u8* p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128());
+}
+
+
+static inline void storePixel16(u8* p, __m128i x, int bpp) {
+    int32_t v = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+    memcpy(p, &v, bpp);
+}
+#endif
+
+
+// Residuals of row under filter, up is the previous row (zeros for the first)
+void bmpFilterRow(const u8* row, const u8* up, u8* out, size_t n, int bpp, int filter) {
+    size_t i = 0;
+    if (filter == BMP_FILTER_NONE) {
+        memcpy(out, row, n);
+        return;
+    }
+    if (filter == BMP_FILTER_SUB) {
+        deltaEncodeBuf(row, out, n, bpp);
+        return;
+    }
+    for (; i < n && i < (size_t) bpp; i++) {
+        out[i] = row[i] - (filter == BMP_FILTER_AVG ? up[i] >> 1 : up[i]);
+    }
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (row + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (up + i));
+        __m128i pred;
+        if (filter == BMP_FILTER_UP) {
+            pred = b;
+        } else {
+            __m128i a = _mm_loadu_si128((const __m128i*) (row + i - bpp));
+            if (filter == BMP_FILTER_AVG) {
+                // avg_epu8 rounds up, take the carry back off
+                pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            } else {
+                __m128i c = _mm_loadu_si128((const __m128i*) (up + i - bpp));
+                __m128i lo = paethPredict16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                                            _mm_unpacklo_epi8(c, zero));
+                __m128i hi = paethPredict16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                                            _mm_unpackhi_epi8(c, zero));
+                pred = _mm_packus_epi16(lo, hi);
+            }
+        }
+        _mm_storeu_si128((__m128i*) (out + i), _mm_sub_epi8(x, pred));
+    }
+#endif
+    for (; i < n; i++) {
+        int a = row[i - bpp];
+        int b = up[i];
+        int pred = b;
+        if (filter == BMP_FILTER_AVG) {
+            pred = (a + b) >> 1;
+        } else if (filter == BMP_FILTER_PAETH) {
+            pred = paethPredict(a, b, up[i - bpp]);
+        }
+        out[i] = row[i] - pred;
+    }
+}
+
+
+// Undo bmpFilterRow, row and up need BMP_ROW_SLACK bytes past n
+void bmpUnfilterRow(const u8* in, const u8* up, u8* row, size_t n, int bpp, int filter) {
+    size_t i = 0;
+    if (filter == BMP_FILTER_NONE) {
+        memcpy(row, in, n);
+        return;
+    }
+    if (filter == BMP_FILTER_SUB) {
+        deltaDecodeBuf(in, row, n, bpp);
+        return;
+    }
+    if (filter == BMP_FILTER_UP) {
+#ifdef __SSE2__
+        for (; i + 16 <= n; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+            __m128i b = _mm_loadu_si128((const __m128i*) (up + i));
+            _mm_storeu_si128((__m128i*) (row + i), _mm_add_epi8(x, b));
+        }
+#endif
+        for (; i < n; i++) {
+            row[i] = in[i] + up[i];
+        }
+        return;
+    }
+    for (; i < n && i < (size_t) bpp; i++) {
+        row[i] = in[i] + (filter == BMP_FILTER_AVG ? up[i] >> 1 : up[i]);
+    }
+#ifdef __SSE2__
+    // Left depends on the pixel just decoded, so go a pixel at a time with the
+    // channels in lanes and keep that pixel in a register
+    const __m128i lowByte = _mm_set1_epi16(0xff);
+    __m128i a = loadPixel16(row + i - bpp);
+    for (; i + bpp <= n; i += bpp) {
+        __m128i x = loadPixel16(in + i);
+        __m128i b = loadPixel16(up + i);
+        __m128i pred;
+        if (filter == BMP_FILTER_AVG) {
+            pred = _mm_srli_epi16(_mm_add_epi16(a, b), 1);
+        } else {
+            pred = paethPredict16(a, b, loadPixel16(up + i - bpp));
+        }
+        a = _mm_and_si128(_mm_add_epi16(x, pred), lowByte);
+        storePixel16(row + i, a, bpp);
+    }
+#endif
+    for (; i < n; i++) {
+        int a = row[i - bpp];
+        int b = up[i];
+        int pred = filter == BMP_FILTER_AVG ? (a + b) >> 1 : paethPredict(a, b, up[i - bpp]);
+        row[i] = in[i] + pred;
+    }
+}
+
+
+// Sum of absolute residuals, reading bytes as signed
+static size_t bmpFilterCost(const u8* buf, size_t n) {
+    size_t cost = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (buf + i));
+        __m128i absX = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(absX, zero));
+    }
+    cost = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
+    for (; i < n; i++) {
+        cost += abs((int8_t) buf[i]);
+    }
+    return cost;
+}
+
+
+// Bytes per pixel for the filters, anything under a byte uses 1 like PNG
+static int bmpFilterBpp(BMPFileHeader* h) {
+    int bpp = h->bitsPerPixel < 8 ? 1 : h->bitsPerPixel / 8;
+    ASSERT(bpp <= 4, "Error: BMP filters only support up to 32 bits per pixel.\n");
+    return bpp;
+}
+
+
+void bmpFilterTransform(FILE* infp, FILE* outfp) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    copyBMPHeader(infp, outfp, &h);
+
+    int bpp = bmpFilterBpp(&h);
+    size_t rowBytes = bmpRowBytes(&h);
+    size_t rowsLeft = bmpNumRows(&h);
+    size_t bandRows = BMP_BAND_SIZE / (rowBytes + 1) + 1;
+
+    // The first row of the band holds the last row of the band before
+    u8* band = (u8*) calloc((bandRows + 1) * rowBytes + BMP_ROW_SLACK, 1);
+    u8* trials = (u8*) malloc(BMP_NUM_FILTERS * rowBytes);
+    ASSERT(band && trials, "Error: Out of memory in bmpFilterTransform.\n");
+
+    while (rowsLeft > 0) {
+        size_t nRows = rowsLeft < bandRows ? rowsLeft : bandRows;
+        size_t got = fread(band + rowBytes, 1, nRows * rowBytes, infp);
+        ASSERT(got == nRows * rowBytes, "Error in bmpFilterTransform: Unexpected end of file in image data.\n");
+        for (size_t r=1; r <= nRows; r++) {
+            u8* row = band + r * rowBytes;
+            int best = 0;
+            size_t bestCost = SIZE_MAX;
+            for (int f=0; f < BMP_NUM_FILTERS; f++) {
+                bmpFilterRow(row, row - rowBytes, trials + f * rowBytes, rowBytes, bpp, f);
+                size_t cost = bmpFilterCost(trials + f * rowBytes, rowBytes);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    best = f;
+                }
+            }
+            fputc(best, outfp);
+            fwrite(trials + best * rowBytes, 1, rowBytes, outfp);
+        }
+        memcpy(band, band + nRows * rowBytes, rowBytes);
+        rowsLeft -= nRows;
+    }
+    free(trials);
+    free(band);
+
+    copyRemaining(infp, outfp);
+}
+
+
+void invBmpFilterTransform(FILE* infp, FILE* outfp) {
+    BMPFileHeader h;
+    readBMPHeader(infp, &h);
+    copyBMPHeader(infp, outfp, &h);
+
+    int bpp = bmpFilterBpp(&h);
+    size_t rowBytes = bmpRowBytes(&h);
+    size_t rowsLeft = bmpNumRows(&h);
+    size_t bandRows = BMP_BAND_SIZE / (rowBytes + 1) + 1;
+
+    u8* in = (u8*) malloc(bandRows * (rowBytes + 1) + BMP_ROW_SLACK);
+    u8* band = (u8*) calloc((bandRows + 1) * rowBytes + BMP_ROW_SLACK, 1);
+    ASSERT(in && band, "Error: Out of memory in invBmpFilterTransform.\n");
+
+    while (rowsLeft > 0) {
+        size_t nRows = rowsLeft < bandRows ? rowsLeft : bandRows;
+        size_t got = fread(in, 1, nRows * (rowBytes + 1), infp);
+        ASSERT(got == nRows * (rowBytes + 1), "Error in invBmpFilterTransform: Unexpected end of file in image data.\n");
+        for (size_t r=1; r <= nRows; r++) {
+            const u8* coded = in + (r - 1) * (rowBytes + 1);
+            ASSERT(coded[0] < BMP_NUM_FILTERS, "Error in invBmpFilterTransform: Bad row filter.\n");
+            u8* row = band + r * rowBytes;
+            bmpUnfilterRow(coded + 1, row - rowBytes, row, rowBytes, bpp, coded[0]);
+        }
+        fwrite(band + rowBytes, 1, nRows * rowBytes, outfp);
+        memcpy(band, band + nRows * rowBytes, rowBytes);
+        rowsLeft -= nRows;
+    }
+    free(band);
+    free(in);
+
+    copyRemaining(infp, outfp);
+}
+
+
+
+// Number of bytes at the start of p (at most n) equal to c, 16 or 32 at a time
+static inline size_t rleScanRun(const u8* p, size_t n, u8 c) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi8((char) c);
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (p + i));
+        uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, key));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i key = _mm_set1_epi8((char) c);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (p + i));
+        uint32_t mask = ~(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, key)) & 0xffff;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < n && p[i] == c) {
+        i++;
+    }
+    return i;
+}
+
+
+/*
+ * Simple run length encoding (that can handle 0 byte):
+ *
+ * Compression Ratios:
+ * ==========================
+ * enwik9-sm                    1.00148
+ * image.bmp                    1.00088
+ * image.bmp (w/ rgbTransform)  1.06309
+ *
+ * Note: Previously used 0 as a padding byte but this lead to pretty bad
+ * expansion in image file. However the perfrmance was better on enwik9-sm.
+ * This is because there are no 0 bytes in that file. This version handles
+ * 0s more gracefully.
+ *
+ * Format: runs of 3 or more are 3 copies then the number of extra repeats (at most
+ * 255, longer runs are split). Runs are found a buffer at a time.
+ */
+#define RLE_MAX_RUN (0xff + 3)
+
+static void rleEmitRun(ByteWriter* bw, u8 c, uint64_t count) {
+    while (count > 0) {
+        uint64_t n = count < RLE_MAX_RUN ? count : RLE_MAX_RUN;
+        if (n < 3) {
+            bwFill(bw, c, n);
+        } else {
+            bwFill(bw, c, 3);
+            // n more repeats
+            bwPut(bw, (u8) (n - 3));
+        }
+        count -= n;
+    }
+}
+
+
+void compRLE(FILE *infp, FILE *outfp) {
+    ByteReader br;
+    brOpen(&br, infp);
+    ByteWriter bw;
+    bwOpen(&bw, outfp);
+
+    // Runs carry over from one buffer to the next
+    int last = EOF;
+    uint64_t count = 0;
+    const u8* in;
+    size_t n;
+    while ((n = brSpan(&br, &in)) > 0) {
+        size_t i = 0;
+        while (i < n) {
+            if (in[i] != last) {
+                rleEmitRun(&bw, (u8) last, count);
+                last = in[i];
+                count = 0;
+            }
+            size_t len = rleScanRun(in + i, n - i, (u8) last);
+            count += len;
+            i += len;
+        }
+        brSkip(&br, n);
+    }
+    rleEmitRun(&bw, (u8) last, count);
+
+    bwClose(&bw);
+    brClose(&br);
+}
+
+
+void decompRLE(FILE *infp, FILE *outfp) {
+    ByteReader br;
+    brOpen(&br, infp);
+    ByteWriter bw;
+    bwOpen(&bw, outfp);
+
+    int last = EOF;
+    int count = 0;
+    int curr;
+    while ((curr = brGet(&br)) != EOF) {
+        if (curr == last) {
+            count++;
+        } else {
+            last = curr;
+            count = 1;
+        }
+        bwPut(&bw, (u8) curr);
+        if (count == 3) {
+            int extra = brGet(&br);
+            // A properly formatted file always has the count after 3 repeats
+            ASSERT(extra != EOF, "Error in decompRLE: Unexpected end of file after run.\n");
+            bwFill(&bw, (u8) last, extra);
+            last = EOF;
+            count = 0;
+        }
+    }
+
+    bwClose(&bw);
+    brClose(&br);
+}
+
+
+/*
+ *  Zero run length encoding (for MTF output)
+ *
+ *  Zero runs are written as bijective base-2 numbers with two digit symbols, RUNA
+ *  (1) and RUNB (2), least significant first, as bzip2 does. Runs of ZRLE_LONG_RUN
+ *  or more use an escape and a varint instead. Other ranks go up by one to make room
+ *  for the digits; the two that don't fit any more are escaped.
+ *
+ *  Symbols: 0 RUNA, 1 RUNB, 2-254 ranks 1-253, 255 escape then 0 (rank 254),
+ *  1 (rank 255) or 2 followed by the varint length of a long run minus ZRLE_LONG_RUN.
+ */
+#define ZRLE_RUNA 0
+#define ZRLE_RUNB 1
+#define ZRLE_ESCAPE 255
+#define ZRLE_LONG_RUN 64
+
+static void zrleEmitRun(ByteWriter* bw, uint64_t len) {
+    if (len >= ZRLE_LONG_RUN) {
+        u8 varint[10];
+        int size = writeVarint(varint, len - ZRLE_LONG_RUN);
+        bwPut(bw, ZRLE_ESCAPE);
+        bwPut(bw, 2);
+        for (int i=0; i < size; i++) {
+            bwPut(bw, varint[i]);
+        }
+        return;
+    }
+    while (len > 0) {
+        if (len & 1) {
+            bwPut(bw, ZRLE_RUNA);
+            len = (len - 1) >> 1;
+        } else {
+            bwPut(bw, ZRLE_RUNB);
+            len = (len - 2) >> 1;
+        }
+    }
+}
+
+
+void zeroRunTransform(FILE* infp, FILE* outfp) {
+    ByteReader br;
+    brOpen(&br, infp);
+    ByteWriter bw;
+    bwOpen(&bw, outfp);
+
+    uint64_t zeros = 0;
+    const u8* in;
+    size_t n;
+    while ((n = brSpan(&br, &in)) > 0) {
+        size_t i = 0;
+        while (i < n) {
+            if (in[i] == 0) {
+                size_t len = rleScanRun(in + i, n - i, 0);
+                zeros += len;
+                i += len;
+                continue;
+            }
+            if (zeros) {
+                zrleEmitRun(&bw, zeros);
+                zeros = 0;
+            }
+            int rank = in[i++];
+            if (rank < ZRLE_ESCAPE - 1) {
+                bwPut(&bw, (u8) (rank + 1));
+            } else {
+                bwPut(&bw, ZRLE_ESCAPE);
+                bwPut(&bw, (u8) (rank - (ZRLE_ESCAPE - 1)));
+            }
+        }
+        brSkip(&br, n);
+    }
+    if (zeros) {
+        zrleEmitRun(&bw, zeros);
+    }
+
+    bwClose(&bw);
+    brClose(&br);
+}
+
+
+void invZeroRunTransform(FILE* infp, FILE* outfp) {
+    ByteReader br;
+    brOpen(&br, infp);
+    ByteWriter bw;
+    bwOpen(&bw, outfp);
+
+    // Bijective digits seen so far
+    uint64_t run = 0;
+    int place = 0;
+    int c;
+    while ((c = brGet(&br)) != EOF) {
+        if (c <= ZRLE_RUNB) {
+            run += (uint64_t) (c + 1) << place;
+            place++;
+            continue;
+        }
+        bwFill(&bw, 0, run);
+        run = 0;
+        place = 0;
+        if (c != ZRLE_ESCAPE) {
+            bwPut(&bw, (u8) (c - 1));
+            continue;
+        }
+        int e = brGet(&br);
+        ASSERT(e != EOF && e <= 2, "Error in invZeroRunTransform: Bad escape.\n");
+        if (e < 2) {
+            bwPut(&bw, (u8) (ZRLE_ESCAPE - 1 + e));
+        } else {
+            bwFill(&bw, 0, brVarint(&br) + ZRLE_LONG_RUN);
+        }
+    }
+    bwFill(&bw, 0, run);
+
+    bwClose(&bw);
+    brClose(&br);
+}
+
+
+
+/*
+ *  Word replacing text transform (for XML/wiki text)
+ *
+ *  Frequent words and simple XML tags are counted over the first WRT_SAMPLE_SIZE
+ *  bytes and replaced by 1 or 2 byte codes from 128 up. Words are runs of letters,
+ *  looked up in lower case with a flag byte before the code for Capitalised or
+ *  UPPER case words. The common XML entities get a byte each, and in files that
+ *  mostly end lines with \r\n those become \n (a lone \n is escaped). Input bytes
+ *  that collide with any of these are escaped.
+ *
+ *  Format: flags (bit 0 set for \r\n line endings), varint word count, each word as
+ *  a length byte then its bytes, then the coded text.
+ *
+ *  Symbols: 1 capitalised, 2 upper case, 3 escape then a raw byte, 4-7 &quot;
+ *  &amp; &lt; &gt;, 128 up a word code (the first WRT_ONE_BYTE_CODES are one byte,
+ *  the rest take a second byte from 128 up). Anything else is itself.
+ *
+ * Compression Ratios (enwik-4m, without -> with the transform first):
+ * ==========================
+ * huffmanCompress              1.76813 -> 3.48625
+ * lzOptCompress                3.99974 -> 4.50746
+ * BWT, MTF-1, zero run, Huffman 4.72254 -> 4.86628
+ */
+#define WRT_BUF_SIZE (1 << 20)
+#define WRT_SAMPLE_SIZE (4 << 20)
+#define WRT_MAX_WORD 32
+#define WRT_MIN_COUNT 4
+#define WRT_ONE_BYTE_CODES 80
+#define WRT_MAX_WORDS (WRT_ONE_BYTE_CODES + (128 - WRT_ONE_BYTE_CODES) * 128)
+#define WRT_COUNT_LOG 18
+#define WRT_DICT_LOG 15
+// Bytes kept back at the end of a buffer so tokens aren't cut, longer than any token
+#define WRT_CARRY (WRT_MAX_WORD + 16)
+
+enum {WRT_CAP = 1, WRT_UPPER, WRT_ESC, WRT_ENTITY};
+
+// What the encoder does with a byte
+enum {WRT_PLAIN, WRT_LOWER_CASE, WRT_UPPER_CASE, WRT_OPEN_TAG, WRT_AMP, WRT_CR, WRT_LF, WRT_ESCAPED};
+
+#define WRT_NUM_ENTITIES 4
+static const char* wrtEntities[WRT_NUM_ENTITIES] = {"&quot;", "&amp;", "&lt;", "&gt;"};
+static const u8 wrtEntityLens[WRT_NUM_ENTITIES] = {6, 5, 4, 4};
+
+typedef struct WrtEntry {
+    const u8* word;
+    uint32_t hash;
+    uint32_t count;
+    uint32_t len;
+} WrtEntry;
+
+typedef struct WrtDict {
+    int nWords;
+    u8 words[WRT_MAX_WORDS][WRT_MAX_WORD];
+    u8 lens[WRT_MAX_WORDS];
+    // Word index plus 1 by hash, 0 when empty
+    uint16_t table[1 << WRT_DICT_LOG];
+} WrtDict;
+
+
+static void wrtByteClasses(u8* classes) {
+    for (int c=0; c < 256; c++) {
+        if (c >= 'a' && c <= 'z') {
+            classes[c] = WRT_LOWER_CASE;
+        } else if (c >= 'A' && c <= 'Z') {
+            classes[c] = WRT_UPPER_CASE;
+        } else if (c >= WRT_CAP && c < WRT_ENTITY + WRT_NUM_ENTITIES) {
+            classes[c] = WRT_ESCAPED;
+        } else if (c >= 128) {
+            classes[c] = WRT_ESCAPED;
+        } else {
+            classes[c] = c == '<' ? WRT_OPEN_TAG : c == '&' ? WRT_AMP : c == '\r' ? WRT_CR : c == '\n' ? WRT_LF : WRT_PLAIN;
+        }
+    }
+}
+
+
+static inline int wrtIsLetter(const u8* classes, int c) {
+    return (u8) (classes[c] - WRT_LOWER_CASE) <= WRT_UPPER_CASE - WRT_LOWER_CASE;
+}
+
+
+// Words are zero padded to a multiple of 8 bytes so they hash 8 bytes at a time
+static inline uint32_t wrtHash(const u8* word, size_t len) {
+    uint64_t h = len;
+    for (size_t i=0; i < len; i += 8) {
+        uint64_t v;
+        memcpy(&v, word + i, 8);
+        h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    return (uint32_t) (h >> 32);
+}
+
+
+/*
+ *  Length of the token at p (0 if it isn't one): a run of letters or a tag like
+ *  <name>, </name> or "<name ". Letters are folded to lower case into word (zero
+ *  padded, WRT_MAX_WORD + 24 bytes) and *caseFlag gets 0, WRT_CAP or WRT_UPPER,
+ *  or -1 if the token can't be coded.
+ */
+static inline size_t wrtToken(const u8* classes, const u8* p, const u8* end, u8* word, int* caseFlag) {
+    int cls = classes[*p];
+    if (cls == WRT_LOWER_CASE || cls == WRT_UPPER_CASE) {
+        size_t len = 0;
+        int uppers = 0;
+#ifdef __SSE2__
+        if (end - p >= WRT_MAX_WORD + 16) {
+            // Letters are the bytes that fall in a-z once 0x20 is set
+            const __m128i caseBit = _mm_set1_epi8(0x20);
+            const __m128i a = _mm_set1_epi8('a');
+            const __m128i z = _mm_set1_epi8('z' - 'a');
+            for (; len <= WRT_MAX_WORD; len += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i*) (p + len));
+                __m128i folded = _mm_or_si128(x, caseBit);
+                __m128i rel = _mm_sub_epi8(folded, a);
+                __m128i letters = _mm_cmpeq_epi8(_mm_min_epu8(rel, z), rel);
+                __m128i upper = _mm_andnot_si128(_mm_cmpeq_epi8(x, folded), letters);
+                _mm_storeu_si128((__m128i*) (word + len), folded);
+                uint32_t notLetter = ~_mm_movemask_epi8(letters) & 0xffff;
+                uint32_t upperMask = _mm_movemask_epi8(upper);
+                if (notLetter) {
+                    int run = __builtin_ctz(notLetter);
+                    uppers += __builtin_popcount(upperMask & ((1u << run) - 1));
+                    len += run;
+                    break;
+                }
+                uppers += __builtin_popcount(upperMask);
+            }
+        }
+#endif
+        if (len == 0) {
+            size_t max = end - p < WRT_MAX_WORD + 1 ? end - p : WRT_MAX_WORD + 1;
+            while (len < max && wrtIsLetter(classes, p[len])) {
+                uppers += classes[p[len]] == WRT_UPPER_CASE;
+                word[len] = p[len] | 0x20;
+                len++;
+            }
+        }
+        if (len > WRT_MAX_WORD) {
+            // Too long to code, pass all of it through
+            while (p + len < end && wrtIsLetter(classes, p[len])) {
+                len++;
+            }
+            *caseFlag = -1;
+            return len;
+        }
+        memset(word + len, 0, 8);
+        if (uppers == 0) {
+            *caseFlag = 0;
+        } else if (uppers == 1 && cls == WRT_UPPER_CASE) {
+            *caseFlag = WRT_CAP;
+        } else if (uppers == (int) len && len > 1) {
+            *caseFlag = WRT_UPPER;
+        } else {
+            *caseFlag = -1;
+        }
+        return len;
+    }
+    if (cls == WRT_OPEN_TAG) {
+        size_t len = 1;
+        if (p + len < end && p[len] == '/') {
+            len++;
+        }
+        size_t start = len;
+        while (p + len < end && len < WRT_MAX_WORD - 1 && wrtIsLetter(classes, p[len])) {
+            len++;
+        }
+        if (len == start || p + len == end || (p[len] != '>' && p[len] != ' ')) {
+            return 0;
+        }
+        len++;
+        memcpy(word, p, len);
+        memset(word + len, 0, 8);
+        *caseFlag = 0;
+        return len;
+    }
+    return 0;
+}
+
+
+static int wrtCompareEntries(const void* a, const void* b) {
+    const WrtEntry* x = (const WrtEntry*) a;
+    const WrtEntry* y = (const WrtEntry*) b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    // Ties by bytes so the dictionary doesn't depend on the hash table order
+    if (x->len != y->len) {
+        return x->len < y->len ? -1 : 1;
+    }
+    return memcmp(x->word, y->word, x->len);
+}
+
+
+static void wrtDictInsert(WrtDict* d, const u8* word, size_t len) {
+    // Rows start zeroed so the copy is padded for the hash
+    memcpy(d->words[d->nWords], word, len);
+    uint32_t mask = (1 << WRT_DICT_LOG) - 1;
+    uint32_t slot = wrtHash(d->words[d->nWords], len) & mask;
+    while (d->table[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    d->lens[d->nWords] = (u8) len;
+    d->nWords++;
+    d->table[slot] = (uint16_t) d->nWords;
+}
+
+
+// Index of word or -1
+static inline int wrtDictFind(const WrtDict* d, const u8* word, size_t len) {
+    uint32_t mask = (1 << WRT_DICT_LOG) - 1;
+    uint32_t slot = wrtHash(word, len) & mask;
+    while (d->table[slot]) {
+        int idx = d->table[slot] - 1;
+        if (d->lens[idx] == len) {
+            // Both sides are zero padded so whole 8 byte chunks compare
+            uint64_t diff = 0;
+            for (size_t i=0; i < len; i += 8) {
+                uint64_t x, y;
+                memcpy(&x, d->words[idx] + i, 8);
+                memcpy(&y, word + i, 8);
+                diff |= x ^ y;
+            }
+            if (diff == 0) {
+                return idx;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+
+// Count the tokens of text and keep the ones a code makes shorter, most frequent first
+static void wrtBuildDict(WrtDict* d, const u8* classes, const u8* text, size_t n) {
+    size_t tableSize = (size_t) 1 << WRT_COUNT_LOG;
+    WrtEntry* table = (WrtEntry*) calloc(tableSize, sizeof(WrtEntry));
+    // Folded copies of the words in the table
+    u8* arena = (u8*) malloc(n + WRT_MAX_WORD);
+    ASSERT(table && arena, "Error: Out of memory in wrtBuildDict.\n");
+    size_t arenaPos = 0;
+    size_t nEntries = 0;
+
+    const u8* end = text + n;
+    const u8* p = text;
+    u8 word[WRT_MAX_WORD + 24];
+    while (p < end) {
+        int caseFlag;
+        size_t len = wrtToken(classes, p, end, word, &caseFlag);
+        if (len == 0) {
+            p++;
+            continue;
+        }
+        p += len;
+        if (caseFlag < 0 || len < 2) {
+            continue;
+        }
+        uint32_t hash = wrtHash(word, len);
+        size_t slot = hash & (tableSize - 1);
+        while (table[slot].count &&
+               (table[slot].hash != hash || table[slot].len != len || memcmp(table[slot].word, word, len))) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (table[slot].count) {
+            table[slot].count++;
+        } else if (nEntries < tableSize / 2) {
+            memcpy(arena + arenaPos, word, len);
+            table[slot].word = arena + arenaPos;
+            table[slot].hash = hash;
+            table[slot].len = len;
+            table[slot].count = 1;
+            arenaPos += len;
+            nEntries++;
+        }
+    }
+
+    // Pack the entries worth a code down to the front and sort them
+    size_t nKept = 0;
+    for (size_t i=0; i < tableSize; i++) {
+        if (table[i].count >= WRT_MIN_COUNT) {
+            table[nKept++] = table[i];
+        }
+    }
+    qsort(table, nKept, sizeof(WrtEntry), wrtCompareEntries);
+
+    memset(d->table, 0, sizeof(d->table));
+    memset(d->words, 0, sizeof(d->words));
+    d->nWords = 0;
+    for (size_t i=0; i < nKept && d->nWords < WRT_MAX_WORDS; i++) {
+        // Two letter words only gain from one byte codes
+        if (d->nWords >= WRT_ONE_BYTE_CODES && table[i].len < 3) {
+            continue;
+        }
+        wrtDictInsert(d, table[i].word, table[i].len);
+    }
+    free(arena);
+    free(table);
+}
+
+
+/*
+ *  Code text[0, n) into out (at least 2n bytes), stopping before the last WRT_CARRY
+ *  bytes unless final. Returns the number of input bytes used, *outLen the output.
+ */
+static size_t wrtEncodeBuf(const WrtDict* d, const u8* classes, int crlf, const u8* text, size_t n,
+                           int final, u8* out, size_t* outLen) {
+    const u8* end = text + n;
+    const u8* stop = final ? end : (n > WRT_CARRY ? end - WRT_CARRY : text);
+    const u8* p = text;
+    u8* o = out;
+    u8 word[WRT_MAX_WORD + 24];
+    while (p < stop) {
+        int c = *p;
+        switch (classes[c]) {
+            case WRT_PLAIN:
+                *o++ = (u8) c;
+                p++;
+                continue;
+            case WRT_LOWER_CASE:
+            case WRT_UPPER_CASE:
+            case WRT_OPEN_TAG: {
+                int caseFlag;
+                size_t len = wrtToken(classes, p, end, word, &caseFlag);
+                if (len == 0) {
+                    break;
+                }
+                int idx = caseFlag < 0 ? -1 : wrtDictFind(d, word, len);
+                if (idx < 0) {
+                    memcpy(o, p, len);
+                    o += len;
+                } else {
+                    if (caseFlag) {
+                        *o++ = (u8) caseFlag;
+                    }
+                    if (idx < WRT_ONE_BYTE_CODES) {
+                        *o++ = (u8) (128 + idx);
+                    } else {
+                        idx -= WRT_ONE_BYTE_CODES;
+                        *o++ = (u8) (128 + WRT_ONE_BYTE_CODES + (idx >> 7));
+                        *o++ = (u8) (128 + (idx & 127));
+                    }
+                }
+                p += len;
+                continue;
+            }
+            case WRT_AMP: {
+                int e = 0;
+                while (e < WRT_NUM_ENTITIES && ((size_t) (end - p) < wrtEntityLens[e] ||
+                                                memcmp(p, wrtEntities[e], wrtEntityLens[e]))) {
+                    e++;
+                }
+                if (e == WRT_NUM_ENTITIES) {
+                    break;
+                }
+                *o++ = (u8) (WRT_ENTITY + e);
+                p += wrtEntityLens[e];
+                continue;
+            }
+            case WRT_CR:
+                if (!crlf || p + 1 == end || p[1] != '\n') {
+                    break;
+                }
+                *o++ = '\n';
+                p += 2;
+                continue;
+            case WRT_LF:
+                if (crlf) {
+                    *o++ = WRT_ESC;
+                }
+                break;
+            case WRT_ESCAPED:
+                *o++ = WRT_ESC;
+                break;
+        }
+        *o++ = (u8) c;
+        p++;
+    }
+    *outLen = o - out;
+    return p - text;
+}
+
 
-    int c;
-    for (int i=0; i < h.height * h.width * (h.bitsPerPixel/8); i++) {
-        c = fgetc(infp);
-        ASSERT(c != EOF, "Error in imgQuantTransform: Unexpected end of file!\n");
-        c = c * fac;
-        fputc((char) c, outfp);
+void wrtTransform(FILE* infp, FILE* outfp) {
+    // The first buffer is the dictionary sample
+    size_t bufSize = WRT_BUF_SIZE > WRT_SAMPLE_SIZE ? WRT_BUF_SIZE : WRT_SAMPLE_SIZE;
+    u8* buf = (u8*) malloc(bufSize);
+    u8* out = (u8*) malloc(2 * bufSize);
+    WrtDict* d = (WrtDict*) malloc(sizeof(WrtDict));
+    ASSERT(buf && out && d, "Error: Out of memory in wrtTransform.\n");
+    u8 classes[256];
+    wrtByteClasses(classes);
+
+    size_t n = fread(buf, 1, bufSize, infp);
+    wrtBuildDict(d, classes, buf, n < WRT_SAMPLE_SIZE ? n : WRT_SAMPLE_SIZE);
+
+    // \r\n endings if most lines have them
+    size_t crlfs = 0;
+    size_t lfs = 0;
+    for (size_t i=0; i < n; i++) {
+        if (buf[i] == '\n') {
+            lfs++;
+            crlfs += i > 0 && buf[i - 1] == '\r';
+        }
+    }
+    int crlf = crlfs > lfs - crlfs;
+
+    u8 varint[10];
+    fputc(crlf, outfp);
+    fwrite(varint, 1, writeVarint(varint, d->nWords), outfp);
+    for (int i=0; i < d->nWords; i++) {
+        fputc(d->lens[i], outfp);
+        fwrite(d->words[i], 1, d->lens[i], outfp);
     }
 
-    copyRemaining(infp, outfp);
+    int final = n < bufSize;
+    while (n > 0) {
+        size_t outLen;
+        size_t used = wrtEncodeBuf(d, classes, crlf, buf, n, final, out, &outLen);
+        fwrite(out, 1, outLen, outfp);
+        memmove(buf, buf + used, n - used);
+        n -= used;
+        if (!final) {
+            size_t got = fread(buf + n, 1, bufSize - n, infp);
+            final = got < bufSize - n;
+            n += got;
+        }
+    }
+
+    free(d);
+    free(out);
+    free(buf);
+}
+
+
+/*
+ *  Decode in[0, n) into out until fewer than 3 input bytes (a whole symbol) are left
+ *  unless final, or out has less than room for the longest symbol before outEnd.
+ *  Returns the number of input bytes used, *outLen the output.
+ */
+static size_t wrtDecodeBuf(const WrtDict* d, int crlf, const u8* in, size_t n, int final,
+                           u8* out, u8* outEnd, size_t* outLen) {
+    const u8* end = in + n;
+    const u8* stop = final ? end : (n > 3 ? end - 3 : in);
+    u8* outStop = outEnd - WRT_MAX_WORD - 8;
+    const u8* p = in;
+    u8* o = out;
+    while (p < stop && o < outStop) {
+        int c = *p++;
+        int caseFlag = 0;
+        if (c == WRT_CAP || c == WRT_UPPER) {
+            caseFlag = c;
+            ASSERT(p < end && *p >= 128, "Error in invWrtTransform: Case flag without a word.\n");
+            c = *p++;
+        }
+        if (c >= 128) {
+            int idx = c - 128;
+            if (idx >= WRT_ONE_BYTE_CODES) {
+                ASSERT(p < end && *p >= 128, "Error in invWrtTransform: Bad word code.\n");
+                idx = WRT_ONE_BYTE_CODES + ((idx - WRT_ONE_BYTE_CODES) << 7) + (*p++ - 128);
+            }
+            ASSERT(idx < d->nWords, "Error in invWrtTransform: Word code out of range.\n");
+            int len = d->lens[idx];
+            memcpy(o, d->words[idx], WRT_MAX_WORD);
+            if (caseFlag == WRT_CAP) {
+                o[0] &= ~0x20;
+            } else if (caseFlag == WRT_UPPER) {
+                for (int i=0; i < len; i++) {
+                    o[i] &= ~0x20;
+                }
+            }
+            o += len;
+        } else if (c == WRT_ESC) {
+            ASSERT(p < end, "Error in invWrtTransform: Escape at end of input.\n");
+            *o++ = *p++;
+        } else if (c >= WRT_ENTITY && c < WRT_ENTITY + WRT_NUM_ENTITIES) {
+            memcpy(o, wrtEntities[c - WRT_ENTITY], wrtEntityLens[c - WRT_ENTITY]);
+            o += wrtEntityLens[c - WRT_ENTITY];
+        } else {
+            if (crlf && c == '\n') {
+                *o++ = '\r';
+            }
+            *o++ = (u8) c;
+        }
+    }
+    *outLen = o - out;
+    return p - in;
+}
+
+
+void invWrtTransform(FILE* infp, FILE* outfp) {
+    int crlf = fgetc(infp);
+    if (crlf == EOF) {
+        return;
+    }
+    WrtDict* d = (WrtDict*) malloc(sizeof(WrtDict));
+    u8* in = (u8*) malloc(WRT_BUF_SIZE);
+    u8* out = (u8*) malloc(WRT_BUF_SIZE);
+    ASSERT(d && in && out, "Error: Out of memory in invWrtTransform.\n");
+    d->nWords = (int) readVarintFile(infp);
+    ASSERT(d->nWords <= WRT_MAX_WORDS, "Error in invWrtTransform: Too many words.\n");
+    for (int i=0; i < d->nWords; i++) {
+        int len = fgetc(infp);
+        ASSERT(len != EOF && len <= WRT_MAX_WORD, "Error in invWrtTransform: Bad word length.\n");
+        d->lens[i] = (u8) len;
+        ASSERT(fread(d->words[i], 1, len, infp) == (size_t) len, "Error in invWrtTransform: Dictionary cut short.\n");
+    }
+
+    size_t n = 0;
+    int final = 0;
+    do {
+        if (!final) {
+            size_t got = fread(in + n, 1, WRT_BUF_SIZE - n, infp);
+            final = got < WRT_BUF_SIZE - n;
+            n += got;
+        }
+        size_t outLen;
+        size_t used = wrtDecodeBuf(d, crlf, in, n, final, out, out + WRT_BUF_SIZE, &outLen);
+        fwrite(out, 1, outLen, outfp);
+        memmove(in, in + used, n - used);
+        n -= used;
+    } while (n > 0 || !final);
+
+    free(out);
+    free(in);
+    free(d);
 }
 
 
 /*
- *  Split a BMP image into separate RGB channels
+ *  Transform pipeline
  *
+ *  Stages pass their data in memory through two buffers that swap roles each stage,
+ *  so a buffer only grows when a stage's output outgrows it. While the two buffers
+ *  would go over the memory budget (COMP_PIPE_MEM in MiB) a stage's output spills
+ *  to a temp file instead. FILE* transforms read and write the buffers through
+ *  cookie streams; transforms with a buffer version skip the streams.
  */
-void rgbTransform(FILE* infp, FILE* outfp) {
-    BMPFileHeader h;
-    readBMPHeader(infp, &h);
-    ASSERT((h.width * h.bitsPerPixel/8) % 4 == 0, "Error in rgbTransform: Row size not multiple of 4 bytes, handling padding not yet implemented.\n");
-    ASSERT(h.bitsPerPixel == 24, "Error in rgbTransform: support for bitsPerPixel other than 24 not implemented.\n");
+#define PIPE_DEFAULT_MEM_MB 1024
+#define PIPE_STREAM_BUF_SIZE (1 << 16)
+
+typedef struct Buf {
+    u8* data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+// Buffer version of a transform: in[0, n) to the end of out
+typedef void (*BufTformPtr)(const u8* in, size_t n, Buf* out);
+
+typedef struct PipeBuf {
+    Buf buf;
+    // Set when the data spilled to a temp file
+    FILE* spill;
+    size_t budget;
+} PipeBuf;
+
+typedef struct PipeSource {
+    const u8* data;
+    size_t len;
+    size_t pos;
+} PipeSource;
+
+
+void bufReserve(Buf* b, size_t need) {
+    if (need <= b->cap) {
+        return;
+    }
+    size_t cap = b->cap ? b->cap : PIPE_STREAM_BUF_SIZE;
+    while (cap < need) {
+        cap *= 2;
+    }
+    b->data = (u8*) realloc(b->data, cap);
+    ASSERT(b->data, "Error: Out of memory in bufReserve.\n");
+    b->cap = cap;
+}
 
-    char *blue = (char*) malloc(3 * h.width * h.height);
-    char *green = blue + h.width * h.height;
-    char *red = green + h.width * h.height;
 
-    copyBMPHeader(infp, outfp, &h);
+size_t pipeMemFromEnv(void) {
+    char* env = getenv("COMP_PIPE_MEM");
+    size_t mb = env ? (size_t) atol(env) : PIPE_DEFAULT_MEM_MB;
+    return mb << 20;
+}
 
-    // Split into 3 color channels
-    int rOff = 0;
-    int gOff = 0;
-    int bOff = 0;
-    for (int i=0; i < h.height; i++) {
-        for (int j=0; j < h.width; j++) {
-            int b = fgetc(infp);
-            int g = fgetc(infp);
-            int r = fgetc(infp);
-            ASSERT((b != EOF) && (g != EOF) && (r != EOF), "Error in rgbTransform: Unexpected end of file in image data.\n");
-            *(blue+bOff) = (char) b;
-            *(green+gOff) = (char) g;
-            *(red+rOff) = (char) r;
-            bOff++;
-            gOff++;
-            rOff++;
+
+static ssize_t pipeSinkWrite(void* cookie, const char* data, size_t size) {
+    PipeBuf* p = (PipeBuf*) cookie;
+    if (!p->spill && p->buf.len + size > p->budget) {
+        p->spill = tmpfile();
+        ASSERT(p->spill, "Error: Could not create spill file in applyTformStack.\n");
+        if (p->buf.len) {
+            fwrite(p->buf.data, 1, p->buf.len, p->spill);
         }
+        p->buf.len = 0;
     }
-    
-    // Write the separated color channels sequentially (all red, then green, then blue)
-    for (int i=0; i < 3 * h.width * h.height; i++) {
-        char c = *(blue+i);
-        fputc(c, outfp);
+    if (p->spill) {
+        return fwrite(data, 1, size, p->spill) == size ? (ssize_t) size : -1;
     }
+    bufReserve(&p->buf, p->buf.len + size);
+    memcpy(p->buf.data + p->buf.len, data, size);
+    p->buf.len += size;
+    return size;
+}
 
-    // If there's anything else copy it over.
-    copyRemaining(infp, outfp);
 
-    free(blue);
+static ssize_t pipeSourceRead(void* cookie, char* data, size_t size) {
+    PipeSource* s = (PipeSource*) cookie;
+    size_t n = s->len - s->pos < size ? s->len - s->pos : size;
+    memcpy(data, s->data + s->pos, n);
+    s->pos += n;
+    return n;
 }
 
 
-void invRGBTransform(FILE *infp, FILE *outfp) {
-    BMPFileHeader h;
-    readBMPHeader(infp, &h);
-    ASSERT((h.width * h.bitsPerPixel/8) % 4 == 0, "Error in rgbTransform: Row size not multiple of 4 bytes, handling padding not yet implemented.\n");
-    ASSERT(h.bitsPerPixel == 24, "Error in rgbTransform: support for bitsPerPixel other than 24 not implemented.\n");
+static int pipeSourceSeek(void* cookie, off64_t* offset, int whence) {
+    PipeSource* s = (PipeSource*) cookie;
+    off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off64_t) s->pos : (off64_t) s->len;
+    off64_t pos = base + *offset;
+    if (pos < 0 || pos > (off64_t) s->len) {
+        return -1;
+    }
+    s->pos = pos;
+    *offset = pos;
+    return 0;
+}
 
-    char *pixels = (char*) malloc(3 * h.width * h.height);
 
-    copyBMPHeader(infp, outfp, &h);
+// FILE* that appends to p, spilling past p->budget
+FILE* pipeOpenSink(PipeBuf* p) {
+    cookie_io_functions_t io = {NULL, pipeSinkWrite, NULL, NULL};
+    FILE* fp = fopencookie(p, "w", io);
+    ASSERT(fp, "Error: Could not open pipeline sink.\n");
+    setvbuf(fp, NULL, _IOFBF, PIPE_STREAM_BUF_SIZE);
+    return fp;
+}
 
-    // Extract color channels into one pixel array with 3 colors per pixel
-    for (int color=0; color < 3; color++) {
-        for (int i=0; i < h.width * h.height; i++) {
-            int c = fgetc(infp);
-            ASSERT(c != EOF, "Error in rgbInvTransform: Unexpected end of file in image data\n");
-            *(pixels + 3 * i + color) = (char) c;
-        }
+
+// FILE* reading the data in p, src has to live until it's closed
+FILE* pipeOpenSource(PipeBuf* p, PipeSource* src) {
+    if (p->spill) {
+        rewind(p->spill);
+        return p->spill;
     }
+    src->data = p->buf.data;
+    src->len = p->buf.len;
+    src->pos = 0;
+    cookie_io_functions_t io = {pipeSourceRead, NULL, pipeSourceSeek, NULL};
+    FILE* fp = fopencookie(src, "r", io);
+    ASSERT(fp, "Error: Could not open pipeline source.\n");
+    setvbuf(fp, NULL, _IOFBF, PIPE_STREAM_BUF_SIZE);
+    spanRegister(fp, src->data, src->len);
+    return fp;
+}
+
 
-    // Write combined color array
-    for (int i=0; i < 3 * h.width * h.height; i++) {
-        fputc(*(pixels+i), outfp);
+static void pipeCloseSource(PipeBuf* p, FILE* fp) {
+    if (fp != p->spill) {
+        spanForget(fp);
+        fclose(fp);
     }
-    free(pixels);
+}
 
-    copyRemaining(infp, outfp);
 
-    
+// Empty p, keeping its buffer
+static void pipeReset(PipeBuf* p) {
+    if (p->spill) {
+        fclose(p->spill);
+        p->spill = NULL;
+    }
+    p->buf.len = 0;
 }
 
 
-/*
- *  Relative encoding
- *  
- *  NOTE: Does not work with stdin
- */
-void compRelative(FILE *infp, FILE *outfp) {
-    int curr, last;
-    int min = 255;
-    int max = -256;
-    last = fgetc(infp);
-    // File is empty
-    if (last == EOF) {
+static void mtfSpan(const u8* in, size_t n, Buf* out, MtfBufPtr fn) {
+    u8 table[256];
+    mtfInitTable(table);
+    bufReserve(out, out->len + n);
+    fn(table, in, out->data + out->len, n);
+    out->len += n;
+}
+
+
+static void mtfEncodeSpan(const u8* in, size_t n, Buf* out) {
+    mtfSpan(in, n, out, mtfEncodeBuf);
+}
+
+
+static void mtfDecodeSpan(const u8* in, size_t n, Buf* out) {
+    mtfSpan(in, n, out, mtfDecodeBuf);
+}
+
+
+static void mtf1EncodeSpan(const u8* in, size_t n, Buf* out) {
+    mtfSpan(in, n, out, mtf1EncodeBuf);
+}
+
+
+static void mtf1DecodeSpan(const u8* in, size_t n, Buf* out) {
+    mtfSpan(in, n, out, mtf1DecodeBuf);
+}
+
+
+// Buffer versions of FILE* transforms, these write as many bytes as they read
+static const struct {
+    TformPtr file;
+    BufTformPtr buf;
+} pipeBufTforms[] = {
+    {moveToFrontTransform, mtfEncodeSpan},
+    {invMoveToFrontTransform, mtfDecodeSpan},
+    {mtf1Transform, mtf1EncodeSpan},
+    {invMtf1Transform, mtf1DecodeSpan},
+};
+
+
+BufTformPtr pipeBufTform(TformPtr t) {
+    for (size_t i=0; i < sizeof(pipeBufTforms) / sizeof(pipeBufTforms[0]); i++) {
+        if (pipeBufTforms[i].file == t) {
+            return pipeBufTforms[i].buf;
+        }
+    }
+    return NULL;
+}
+
+
+// Run t from in to out, out gets what's left of the budget
+static void pipeRunStage(TformPtr t, PipeBuf* in, PipeBuf* out, size_t budget) {
+    size_t used = in->spill ? 0 : in->buf.len;
+    out->budget = budget > used ? budget - used : 0;
+
+    BufTformPtr bufTform = pipeBufTform(t);
+    if (bufTform && !in->spill && in->buf.len <= out->budget) {
+        bufTform(in->buf.data, in->buf.len, &out->buf);
         return;
     }
 
-    while ((curr = fgetc(infp)) != EOF) {
-        int diff = curr - last;
-        if (diff < min) {
-            min = diff;
-        }
-        if (diff > max) {
-            max = diff;
+    PipeSource src;
+    FILE* infp = pipeOpenSource(in, &src);
+    FILE* outfp = pipeOpenSink(out);
+    t(infp, outfp);
+    fclose(outfp);
+    pipeCloseSource(in, infp);
+}
+
+
+/*
+ *  Streaming pipeline (COMP_PIPE_STREAM=1)
+ *
+ *  Every stage runs on its own thread, connected to the next by a PIPE_RING_SIZE
+ *  single producer, single consumer ring so stages overlap and memory doesn't grow
+ *  with the input. The ring is lock free: the writer only moves head and the reader
+ *  only moves tail. A side with nothing to do yields for a while and then parks on
+ *  a condition variable until the other side moves. Stages that seek their input
+ *  collect all of it first (under the memory budget) and run after.
+ */
+#define PIPE_RING_SIZE (4 << 20)
+// Yields before a waiting side parks
+#define PIPE_SPINS 64
+
+typedef struct PipeRing {
+    u8* data;
+    // Bytes ever written and read
+    size_t head;
+    size_t tail;
+    int closed;
+    int readerGone;
+    // Only used once a side has spun out and parks
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    int waiting;
+} PipeRing;
+
+typedef struct PipeStage {
+    TformPtr tform;
+    FILE* in;
+    FILE* out;
+    // Set for rings, the caller's files are left open
+    int closeIn;
+    int closeOut;
+    size_t budget;
+} PipeStage;
+
+// Transforms that seek their input
+static const TformPtr pipeSeekingTforms[] = {
+    huffmanCompress, rangeCompress,
+    imgQuantTransform, invImgQuantTransform, rgbTransform, invRGBTransform,
+    ycocgTransform, invYcocgTransform, bmpFilterTransform, invBmpFilterTransform,
+};
+
+
+int pipeStreamFromEnv(void) {
+    char* env = getenv("COMP_PIPE_STREAM");
+    return env && atoi(env) != 0;
+}
+
+
+static int pipeSeeks(TformPtr t) {
+    for (size_t i=0; i < sizeof(pipeSeekingTforms) / sizeof(pipeSeekingTforms[0]); i++) {
+        if (pipeSeekingTforms[i] == t) {
+            return 1;
         }
     }
+    return 0;
+}
 
-    if ((max - min) > 128) {
-        rewind(infp);
-        fputc(0x00, outfp);
-        while ((curr = fgetc(infp)) != EOF) {
-            fputc((char) curr, outfp);
-        }
+
+// Wait for the other side of r to move, ready re-checks with the lock held
+static void pipeWait(PipeRing* r, int* spins, int (*ready)(PipeRing*)) {
+    if (++*spins < PIPE_SPINS) {
+        sched_yield();
         return;
-    } else {
-        ASSERT(0);
     }
-    
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ready(r)) {
+        pthread_cond_wait(&r->moved, &r->lock);
+    }
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
 }
-void decompRelative(FILE *infp, FILE *outfp) {
-    int curr = fgetc(infp);
-    ASSERT(curr == 0x00);
-    while ((curr = fgetc(infp)) != EOF) {
-        fputc(curr, outfp);
+
+
+// Wake the other side if it's parked in pipeWait
+static void pipeWake(PipeRing* r) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->moved);
+        pthread_mutex_unlock(&r->lock);
     }
 }
 
 
+static int pipeCanWrite(PipeRing* r) {
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < PIPE_RING_SIZE
+        || __atomic_load_n(&r->readerGone, __ATOMIC_SEQ_CST);
+}
 
-/*
- * Simple run length encoding (that can handle 0 byte):
- *
- * Compression Ratios:
- * ==========================
- * enwik9-sm                    1.00148
- * image.bmp                    1.00088
- * image.bmp (w/ rgbTransform)  1.06309
- *
- * Note: Previously used 0 as a padding byte but this lead to pretty bad
- * expansion in image file. However the perfrmance was better on enwik9-sm.
- * This is because there are no 0 bytes in that file. This version handles
- * 0s more gracefully.
- */
-void compRLE(FILE *infp, FILE *outfp) {
-    int curr, last;
-    int count = 1;
-    last = fgetc(infp);
-    if (last == EOF) {
-        return;
+
+static int pipeCanRead(PipeRing* r) {
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST)
+        || __atomic_load_n(&r->closed, __ATOMIC_SEQ_CST);
+}
+
+
+static ssize_t pipeRingWrite(void* cookie, const char* data, size_t size) {
+    PipeRing* r = (PipeRing*) cookie;
+    size_t done = 0;
+    int spins = 0;
+    while (done < size) {
+        size_t head = r->head;
+        size_t room = PIPE_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        if (room == 0) {
+            // Nobody will make room, drop the rest
+            if (__atomic_load_n(&r->readerGone, __ATOMIC_ACQUIRE)) {
+                return size;
+            }
+            pipeWait(r, &spins, pipeCanWrite);
+            continue;
+        }
+        spins = 0;
+        size_t n = size - done < room ? size - done : room;
+        size_t at = head & (PIPE_RING_SIZE - 1);
+        size_t first = n < PIPE_RING_SIZE - at ? n : PIPE_RING_SIZE - at;
+        memcpy(r->data + at, data + done, first);
+        memcpy(r->data, data + done + first, n - first);
+        __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+        pipeWake(r);
+        done += n;
     }
-    while ((curr = fgetc(infp)) != EOF) {
-        if (curr != last || count == 0xff + 3) {
-            if (count < 3) {
-                fputc((char) last, outfp);
-                if (count == 2) {
-                    fputc((char) last, outfp);
-                }
-            } else {
-                fputc((char) last, outfp);
-                fputc((char) last, outfp);
-                fputc((char) last, outfp);
-                // n more repeats
-                fputc((char) count - 3, outfp);
+    return size;
+}
+
+
+static ssize_t pipeRingRead(void* cookie, char* data, size_t size) {
+    PipeRing* r = (PipeRing*) cookie;
+    int spins = 0;
+    for (;;) {
+        size_t tail = r->tail;
+        size_t avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+        if (avail == 0) {
+            // Check head again after seeing closed, the last write may have just landed
+            if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+                return 0;
             }
-            count = 1;
-        } else {
-            count++;
+            pipeWait(r, &spins, pipeCanRead);
+            continue;
         }
-        last = curr;
+        size_t n = size < avail ? size : avail;
+        size_t at = tail & (PIPE_RING_SIZE - 1);
+        size_t first = n < PIPE_RING_SIZE - at ? n : PIPE_RING_SIZE - at;
+        memcpy(data, r->data + at, first);
+        memcpy(data + first, r->data, n - first);
+        __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+        pipeWake(r);
+        return n;
     }
+}
+
+
+static int pipeRingCloseWriter(void* cookie) {
+    __atomic_store_n(&((PipeRing*) cookie)->closed, 1, __ATOMIC_RELEASE);
+    pipeWake((PipeRing*) cookie);
+    return 0;
+}
+
+
+static int pipeRingCloseReader(void* cookie) {
+    __atomic_store_n(&((PipeRing*) cookie)->readerGone, 1, __ATOMIC_RELEASE);
+    pipeWake((PipeRing*) cookie);
+    return 0;
+}
 
-    // Handle last char
-    if (count < 3) {
-        fputc((char) last, outfp);
-        if (count == 2) {
-            fputc((char) last, outfp);
+
+static void* pipeStageThread(void* arg) {
+    PipeStage* s = (PipeStage*) arg;
+    FILE* in = s->in;
+    PipeBuf whole;
+    PipeSource src;
+    int seeks = s->closeIn && pipeSeeks(s->tform);
+    if (seeks) {
+        memset(&whole, 0, sizeof(whole));
+        whole.budget = s->budget;
+        FILE* sink = pipeOpenSink(&whole);
+        u8* buf = (u8*) malloc(PIPE_STREAM_BUF_SIZE);
+        ASSERT(buf, "Error: Out of memory in pipeStageThread.\n");
+        size_t n;
+        while ((n = fread(buf, 1, PIPE_STREAM_BUF_SIZE, in)) > 0) {
+            fwrite(buf, 1, n, sink);
         }
+        free(buf);
+        fclose(sink);
+        in = pipeOpenSource(&whole, &src);
+    }
+
+    s->tform(in, s->out);
+
+    if (seeks) {
+        pipeCloseSource(&whole, in);
+        pipeReset(&whole);
+        free(whole.buf.data);
+    }
+    if (s->closeIn) {
+        fclose(s->in);
+    }
+    if (s->closeOut) {
+        fclose(s->out);
     } else {
-        fputc((char) last, outfp);
-        fputc((char) last, outfp);
-        fputc((char) last, outfp);
-        // n more repeats
-        fputc((char) count - 3, outfp);
+        fflush(s->out);
     }
+    return NULL;
 }
 
 
-void decompRLE(FILE *infp, FILE *outfp) {
-    int curr, last;
-    int count=1;
-    last = fgetc(infp);
-    // empty file
-    if (last == EOF) {
-        return;
+void applyTformStackStreaming(FILE* infp, FILE* outfp, int nTforms, TformPtr* stack) {
+    PipeRing* rings = (PipeRing*) calloc(nTforms - 1, sizeof(PipeRing));
+    PipeStage* stages = (PipeStage*) calloc(nTforms, sizeof(PipeStage));
+    pthread_t* threads = (pthread_t*) malloc(nTforms * sizeof(pthread_t));
+    ASSERT(rings && stages && threads, "Error: Out of memory in applyTformStackStreaming.\n");
+
+    // Stages that seek share the budget
+    int nSeeking = 1;
+    for (int i=1; i < nTforms; i++) {
+        nSeeking += pipeSeeks(stack[i]);
     }
-    while ((curr = fgetc(infp)) != EOF) {
-        if (count == 3) {
-            fputc((char) last, outfp);
-            fputc((char) last, outfp);
-            fputc((char) last, outfp);
-            for (int i=0; i < curr; i++) {
-                fputc((char) last, outfp);
-            }
 
-            last = fgetc(infp);
-            count = 1;
-            if (last == EOF) {
-                break;
-            }
-        } else if (last != curr) {
-            fputc((char) last, outfp);
-            if (count >= 2) {
-                fputc((char) last, outfp);
-            }
-            count = 1;
-            last = curr;
-                
-        } else {
-            count++;
-            last = curr;
+    cookie_io_functions_t writer = {NULL, pipeRingWrite, NULL, pipeRingCloseWriter};
+    cookie_io_functions_t reader = {pipeRingRead, NULL, NULL, pipeRingCloseReader};
+    for (int i=0; i < nTforms; i++) {
+        stages[i].tform = stack[i];
+        stages[i].budget = pipeMemFromEnv() / nSeeking;
+        stages[i].in = infp;
+        stages[i].out = outfp;
+        if (i > 0) {
+            stages[i].in = fopencookie(&rings[i - 1], "r", reader);
+            stages[i].closeIn = 1;
         }
-        
-    } 
-
-    // Check last symbol
-    if (last != EOF) {
-        fputc((char) last, outfp);
-        if (count >= 2) {
-            fputc((char) last, outfp);
+        if (i < nTforms - 1) {
+            rings[i].data = (u8*) malloc(PIPE_RING_SIZE);
+            pthread_mutex_init(&rings[i].lock, NULL);
+            pthread_cond_init(&rings[i].moved, NULL);
+            ASSERT(rings[i].data, "Error: Out of memory in applyTformStackStreaming.\n");
+            stages[i].out = fopencookie(&rings[i], "w", writer);
+            stages[i].closeOut = 1;
         }
-        // For a properly formatted compressed file, we should never get to the end
-        // of the character stream with a count of 3. This would need to be followed
-        // by the number of extra characters even if that number is 0. The loop would
-        // have caught this.
-        ASSERT(count < 3);
+        ASSERT(stages[i].in && stages[i].out, "Error: Could not open pipeline ring.\n");
+        setvbuf(stages[i].in, NULL, _IOFBF, PIPE_STREAM_BUF_SIZE);
+        setvbuf(stages[i].out, NULL, _IOFBF, PIPE_STREAM_BUF_SIZE);
+    }
+
+    for (int i=0; i < nTforms; i++) {
+        ASSERT(pthread_create(&threads[i], NULL, pipeStageThread, &stages[i]) == 0,
+               "Error: Could not start pipeline thread.\n");
     }
+    for (int i=0; i < nTforms; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i=0; i < nTforms - 1; i++) {
+        pthread_mutex_destroy(&rings[i].lock);
+        pthread_cond_destroy(&rings[i].moved);
+        free(rings[i].data);
+    }
+    free(threads);
+    free(stages);
+    free(rings);
 }
 
 
 void applyTformStack(FILE* infp, FILE* outfp, int nTforms, TformPtr* stack) {
     if (nTforms == 1) {
         (*stack)(infp, outfp);
-    } else {
-
-        FILE* tmp1 = tmpfile();
-        ASSERT(tmp1, "Error creating temp file 1 in applyTformStack\n");
-
-        FILE* tmp2 = tmpfile();
-        ASSERT(tmp2, "Error creating temp file 2 in applyTformStack\n");
-
-        FILE* swapTmp;
-
-        // Apply first transform
-        (*stack++)(infp, tmp1);
-        rewind(tmp1);
-        
-        // Apply second to second-to-last transforms
-        for (int i=1; i < nTforms-1; i++) {
-            (*stack++)(tmp1, tmp2);
-            swapTmp = tmp2;
-            tmp2 = tmp1;
-            tmp1 = swapTmp;
-            rewind(tmp1);
-            rewind(tmp2);
-        }
+        return;
+    }
+    if (pipeStreamFromEnv()) {
+        applyTformStackStreaming(infp, outfp, nTforms, stack);
+        return;
+    }
+    size_t budget = pipeMemFromEnv();
+    PipeBuf bufs[2];
+    memset(bufs, 0, sizeof(bufs));
+    PipeBuf* cur = &bufs[0];
+    PipeBuf* next = &bufs[1];
+
+    // Apply first transform
+    cur->budget = budget;
+    FILE* sink = pipeOpenSink(cur);
+    stack[0](infp, sink);
+    fclose(sink);
+
+    // Apply second to second-to-last transforms
+    for (int i=1; i < nTforms-1; i++) {
+        pipeRunStage(stack[i], cur, next, budget);
+        PipeBuf* swap = cur;
+        cur = next;
+        next = swap;
+        pipeReset(next);
+    }
 
-        // Apply last transform
-        (*stack++)(tmp1, outfp);
+    // Apply last transform
+    PipeSource src;
+    FILE* last = pipeOpenSource(cur, &src);
+    stack[nTforms-1](last, outfp);
+    pipeCloseSource(cur, last);
 
-        fclose(tmp1);
-        fclose(tmp2);
-        
+    for (int i=0; i < 2; i++) {
+        pipeReset(&bufs[i]);
+        free(bufs[i].buf.data);
     }
 }
 
@@ -918,11 +6357,11 @@ void testCompression(char *baseFile, int nTforms, TformPtr* compress, TformPtr*
     printf("Compressing file...\n");
     // set fname to "base.file"
     strcpy(fname, baseFile);
-    infp = fopen(fname, "rb");
+    infp = openMapped(fname);
 
     // set fname to "base.file-comp"
     strcat(fname, "-comp");
-    outfp = fopen(fname, "wb");
+    outfp = openSink(fname);
 
     applyTformStack(infp, outfp, nTforms, compress);
 
@@ -938,12 +6377,12 @@ void testCompression(char *baseFile, int nTforms, TformPtr* compress, TformPtr*
     // Decompress file
     printf("Decompressing file...\n");
     // fname is still "base.file-comp"
-    infp = fopen(fname, "rb");
+    infp = openMapped(fname);
     
     // set fname to "base.file-decomp"
     strcpy(fname, baseFile);
     strcat(fname, "-decomp");
-    outfp = fopen(fname, "wb");
+    outfp = openSink(fname);
 
     applyTformStack(infp, outfp, nTforms, decompress);
 
@@ -953,11 +6392,11 @@ void testCompression(char *baseFile, int nTforms, TformPtr* compress, TformPtr*
     // Test correctness
     printf("Checking for differences between base and decompressed...\n");
     // fname is still "base.file-decomp"
-    outfp = fopen(fname, "rb");
+    outfp = openMapped(fname);
     
     // set fname to "base.file"
     strcpy(fname, baseFile);
-    infp = fopen(fname, "rb");
+    infp = openMapped(fname);
 
     int i;
     if ((i = diff_file(infp, outfp))) {
@@ -976,6 +6415,232 @@ void testCompression(char *baseFile, int nTforms, TformPtr* compress, TformPtr*
 
 
 
+/*
+ *  Time histogramming, and single stream against interleaved and order-1 Huffman
+ *  coding and tANS, on a file held in memory
+ */
+void benchEntropy(char *baseFile) {
+    FILE *infp = openMapped(baseFile);
+    ASSERT(infp != NULL, "Error in benchEntropy: Could not open file.\n");
+    size_t n;
+    u8* in = readAll(infp, &n, 0);
+    fclose(infp);
+
+    uint64_t counts[NUM_HUFF_SYMS];
+    double t = nowSeconds();
+    histogram(in, n, counts);
+    printf("Histogram:            %8.1f MB/s\n", n / (nowSeconds() - t) / 1e6);
+    t = nowSeconds();
+    histogramParallel(in, n, counts);
+    printf("Histogram (%d threads):%8.1f MB/s\n", numThreads(), n / (nowSeconds() - t) / 1e6);
+
+    HuffTable table;
+    huffTableFromBuf(&table, in, n);
+    HuffDecTable* dt = (HuffDecTable*) malloc(sizeof(HuffDecTable));
+    buildHuffDecTable(dt, table.codeLens);
+
+    size_t cap = HUFF_JUMP_SIZE + HUFF_NUM_STREAMS * HUFF_BOUND(n / HUFF_NUM_STREAMS + 1) + HUFF_SLACK;
+    u8* comp = (u8*) calloc(cap, 1);
+    u8* out = (u8*) malloc(n + 2);
+    ASSERT(comp && out, "Error: Out of memory in benchEntropy.\n");
+    int reps = 5;
+
+    t = nowSeconds();
+    size_t size = huffEncodeBuf(&table, in, n, comp, cap);
+    printf("Single stream encode: %8.1f MB/s\n", n / (nowSeconds() - t) / 1e6);
+    t = nowSeconds();
+    for (int r=0; r < reps; r++) {
+        BitStream bs;
+        bsReaderFromBuffer(&bs, comp, size);
+        huffDecodeBuf(dt, &bs, out, n);
+    }
+    printf("Single stream decode: %8.1f MB/s (%s)\n", reps * n / (nowSeconds() - t) / 1e6, memcmp(in, out, n) ? "DIFFERENT" : "same");
+
+    memset(comp, 0, cap);
+    t = nowSeconds();
+    size = huffEncodeX4(&table, in, n, comp, cap);
+    printf("%d streams encode:    %8.1f MB/s\n", HUFF_NUM_STREAMS, n / (nowSeconds() - t) / 1e6);
+    t = nowSeconds();
+    for (int r=0; r < reps; r++) {
+        huffDecodeX4(dt, comp, size, out, n);
+    }
+    printf("%d streams decode:    %8.1f MB/s (%s)\n", HUFF_NUM_STREAMS, reps * n / (nowSeconds() - t) / 1e6, memcmp(in, out, n) ? "DIFFERENT" : "same");
+
+    free(comp);
+    cap += HUFF_O1_HEADER_MAX;
+    comp = (u8*) calloc(cap, 1);
+    ASSERT(comp, "Error: Out of memory in benchEntropy.\n");
+    t = nowSeconds();
+    size = huffO1Encode(in, n, comp, cap);
+    printf("Order-1 encode:       %8.1f MB/s (ratio %.4f)\n", n / (nowSeconds() - t) / 1e6, (double) n / size);
+    t = nowSeconds();
+    for (int r=0; r < reps; r++) {
+        huffO1Decode(comp, size, out, n);
+    }
+    printf("Order-1 decode:       %8.1f MB/s (%s)\n", reps * n / (nowSeconds() - t) / 1e6, memcmp(in, out, n) ? "DIFFERENT" : "same");
+
+    free(comp);
+    cap = FSE_BOUND(n);
+    comp = (u8*) calloc(cap + HUFF_SLACK, 1);
+    ASSERT(comp, "Error: Out of memory in benchEntropy.\n");
+    t = nowSeconds();
+    size = fseEncode(in, n, comp, cap);
+    printf("tANS encode:          %8.1f MB/s (ratio %.4f)\n", n / (nowSeconds() - t) / 1e6, (double) n / size);
+    t = nowSeconds();
+    for (int r=0; r < reps; r++) {
+        fseDecode(comp, size, out, n);
+    }
+    printf("tANS decode:          %8.1f MB/s (%s)\n", reps * n / (nowSeconds() - t) / 1e6, memcmp(in, out, n) ? "DIFFERENT" : "same");
+
+    free(out);
+    free(comp);
+    free(dt);
+    free(in);
+}
+
+/*
+ *  Move to front speeds, straight on the file and on its BWT
+ */
+static void benchMTFPair(const char* name, const u8* in, size_t n, MtfBufPtr enc, MtfBufPtr dec) {
+    u8* ranks = (u8*) malloc(n + 1);
+    u8* out = (u8*) malloc(n + 1);
+    ASSERT(ranks && out, "Error: Out of memory in benchMTF.\n");
+    u8 table[256];
+
+    mtfInitTable(table);
+    double t = nowSeconds();
+    enc(table, in, ranks, n);
+    double encTime = nowSeconds() - t;
+    mtfInitTable(table);
+    t = nowSeconds();
+    dec(table, ranks, out, n);
+    double decTime = nowSeconds() - t;
+
+    size_t zeros = 0;
+    for (size_t i=0; i < n; i++) {
+        zeros += ranks[i] == 0;
+    }
+    printf("%-16s encode %8.1f MB/s, decode %8.1f MB/s, %5.1f%% zero ranks (%s)\n", name, n / encTime / 1e6, n / decTime / 1e6, 100.0 * zeros / (n ? n : 1), memcmp(in, out, n) ? "DIFFERENT" : "same");
+    free(out);
+    free(ranks);
+}
+
+
+void benchMTF(char *baseFile) {
+    FILE *infp = openMapped(baseFile);
+    ASSERT(infp != NULL, "Error in benchMTF: Could not open file.\n");
+    size_t n;
+    u8* in = readAll(infp, &n, 0);
+    fclose(infp);
+
+    u8* bwt = (u8*) malloc(n + BWT_HEADER_SIZE);
+    ASSERT(bwt, "Error: Out of memory in benchMTF.\n");
+    size_t bwtLen = 0;
+    for (size_t i=0; i < n; i += BWT_BLOCK_SIZE) {
+        size_t len = n - i < BWT_BLOCK_SIZE ? n - i : BWT_BLOCK_SIZE;
+        // Drop the rows, only the last column matters here
+        bwtEncode(in + i, len, bwt + bwtLen, len + BWT_HEADER_SIZE);
+        memmove(bwt + bwtLen, bwt + bwtLen + BWT_HEADER_SIZE, len);
+        bwtLen += len;
+    }
+
+    benchMTFPair("MTF", in, n, mtfEncodeBuf, mtfDecodeBuf);
+    benchMTFPair("MTF-1", in, n, mtf1EncodeBuf, mtf1DecodeBuf);
+    benchMTFPair("BWT + MTF", bwt, bwtLen, mtfEncodeBuf, mtfDecodeBuf);
+    benchMTFPair("BWT + MTF-1", bwt, bwtLen, mtf1EncodeBuf, mtf1DecodeBuf);
+
+    free(bwt);
+    free(in);
+}
+
+
+/*
+ *  Times a block codec in memory, one block after another on this thread
+ */
+void benchBlockCodec(char *baseFile, char *name, const BlockCodec* codec) {
+    FILE *infp = openMapped(baseFile);
+    ASSERT(infp != NULL, "Error in benchBlockCodec: Could not open file.\n");
+    size_t n;
+    u8* in = readAll(infp, &n, codec->slack);
+    fclose(infp);
+    size_t nBlocks = (n + codec->blockSize - 1) / codec->blockSize;
+    u8* coded = (u8*) malloc(codec->maxCodedSize + codec->slack);
+    u8* out = (u8*) malloc(n + codec->slack);
+    size_t* sizes = (size_t*) malloc((nBlocks + 1) * sizeof(size_t));
+    u8** blocks = (u8**) malloc((nBlocks + 1) * sizeof(u8*));
+    ASSERT(coded && out && sizes && blocks, "Error: Out of memory in benchBlockCodec.\n");
+
+    double t = nowSeconds();
+    size_t total = 0;
+    for (size_t b=0; b < nBlocks; b++) {
+        size_t len = n - b * codec->blockSize < codec->blockSize ? n - b * codec->blockSize : codec->blockSize;
+        sizes[b] = codec->encode(in + b * codec->blockSize, len, coded, codec->maxCodedSize);
+        blocks[b] = (u8*) malloc(sizes[b] + codec->slack);
+        ASSERT(blocks[b], "Error: Out of memory in benchBlockCodec.\n");
+        memcpy(blocks[b], coded, sizes[b]);
+        memset(blocks[b] + sizes[b], 0, codec->slack);
+        total += sizes[b];
+    }
+    double encTime = nowSeconds() - t;
+
+    t = nowSeconds();
+    for (size_t b=0; b < nBlocks; b++) {
+        size_t len = n - b * codec->blockSize < codec->blockSize ? n - b * codec->blockSize : codec->blockSize;
+        codec->decode(blocks[b], sizes[b], out + b * codec->blockSize, len);
+    }
+    double decTime = nowSeconds() - t;
+
+    printf("%s encode: %8.1f MB/s (ratio %.4f)\n", name, n / encTime / 1e6, total ? (double) n / total : 0.0);
+    printf("%s decode: %8.1f MB/s (%s)\n", name, n / decTime / 1e6, memcmp(in, out, n) ? "DIFFERENT" : "same");
+
+    for (size_t b=0; b < nBlocks; b++) {
+        free(blocks[b]);
+    }
+    free(blocks);
+    free(sizes);
+    free(out);
+    free(coded);
+    free(in);
+}
+
+
+/*
+ *  Times a compress/decompress pair through temp files and checks the round trip.
+ */
+void benchTform(char *baseFile, char *name, TformPtr comp, TformPtr decomp) {
+    FILE *infp = openMapped(baseFile);
+    ASSERT(infp != NULL, "Error in benchTform: Could not open file.\n");
+    FILE *compfp = tmpfile();
+    FILE *decompfp = tmpfile();
+    ASSERT(compfp && decompfp, "Error in benchTform: Could not open temp files.\n");
+
+    double t = nowSeconds();
+    comp(infp, compfp);
+    fflush(compfp);
+    double compTime = nowSeconds() - t;
+    long n = ftell(infp);
+    long size = ftell(compfp);
+
+    rewind(compfp);
+    t = nowSeconds();
+    decomp(compfp, decompfp);
+    fflush(decompfp);
+    double decompTime = nowSeconds() - t;
+
+    rewind(infp);
+    rewind(decompfp);
+    int same = !diff_file(infp, decompfp);
+    printf("%s encode: %8.2f MB/s (ratio %.4f)\n", name, n / compTime / 1e6, size ? (double) n / size : 0.0);
+    printf("%s decode: %8.2f MB/s (%s)\n", name, n / decompTime / 1e6, same ? "same" : "DIFFERENT");
+
+    fclose(infp);
+    fclose(compfp);
+    fclose(decompfp);
+}
+
+
+
+
 int main(int argc, char* argv[]) {
     TformPtr compress[1] = {0};
     TformPtr decompress[1] = {0};
@@ -990,11 +6655,11 @@ int main(int argc, char* argv[]) {
 
         strcpy(fname, baseFile);
         printf("In file: %s\n", fname);
-        infp = fopen(fname, "rb"); 
+        infp = openMapped(fname); 
 
         strcat(fname, "-comp");
         printf("Out file: %s\n", fname);
-        outfp = fopen(fname, "wb");
+        outfp = openSink(fname);
 
         ASSERT(infp != NULL && outfp != NULL);
 
@@ -1010,12 +6675,12 @@ int main(int argc, char* argv[]) {
         strcpy(fname, baseFile);
         strcat(fname, "-comp");
         printf("In file: %s\n", fname);
-        infp = fopen(fname, "rb");
+        infp = openMapped(fname);
 
         strcpy(fname, baseFile);
         strcat(fname, "-decomp");
         printf("Out file: %s\n", fname);
-        outfp = fopen(fname, "wb");
+        outfp = openSink(fname);
 
         ASSERT(infp != NULL && outfp != NULL);
 
@@ -1025,15 +6690,45 @@ int main(int argc, char* argv[]) {
         fclose(infp);
         fclose(outfp);
     }
+    else if (argc == 3 && *argv[1] == 'b') {
+        benchEntropy(argv[2]);
+    }
+    else if (argc == 3 && *argv[1] == 'm') {
+        // Context mixing, model size from COMP_CM_MEM (MiB)
+        benchTform(argv[2], "Context mixing", cmCompress, cmDecompress);
+    }
+    else if (argc == 3 && *argv[1] == 'f') {
+        benchMTF(argv[2]);
+    }
+    else if (argc == 3 && *argv[1] == 'l') {
+        // LZ77, window and depth from COMP_LZ_WINDOW (log2) and COMP_LZ_DEPTH
+        benchBlockCodec(argv[2], "LZ77 fast", &lzBlockCodec);
+        benchBlockCodec(argv[2], "LZ77 optimal", &lzOptBlockCodec);
+    }
+    else if (argc == 4 && *argv[1] == 'l') {
+        // Round trip a file through one LZ77 level: 0 fast, 1 optimal parse
+        TformPtr lzComp[1] = {atoi(argv[3]) ? lzOptCompress : lzCompress};
+        TformPtr lzDecomp[1] = {lzDecompress};
+        testCompression(argv[2], 1, lzComp, lzDecomp);
+    }
+    else if (argc == 3 && *argv[1] == 'u') {
+        // Deduplication, index size from COMP_DEDUP_MEM (MiB)
+        benchTform(argv[2], "Dedup", dedupTransform, invDedupTransform);
+    }
+    else if (argc == 3 && *argv[1] == 'r') {
+        // Static whole file coders: Huffman against the range coder
+        benchTform(argv[2], "Huffman", huffmanCompress, huffmanDecompress);
+        benchTform(argv[2], "Range coder", rangeCompress, rangeDecompress);
+    }
     else if (argc == 2 && *argv[1] == 't') {
         printf("Comparing...\n");
 
         strcpy(fname, baseFile);
-        infp = fopen(fname, "rb");
+        infp = openMapped(fname);
         printf("f1: %s\n", fname);
 
         strcat(fname, "-decomp");
-        outfp = fopen(fname, "rb");
+        outfp = openMapped(fname);
         printf("f2: %s\n", fname);
 
         ASSERT(infp != NULL && outfp != NULL);
@@ -1051,31 +6746,10 @@ int main(int argc, char* argv[]) {
     }
     else {
         
-        infp = fopen("enwik9-sm", "rb");
-        float weights[256];
-        int syms[256];
-        rangeArr(256, syms);
-
-        countCharFreqs(infp, weights);
-        
-        HuffTree hTree;
-        buildHuffTree(&hTree, syms, weights);
-        
-        outfp = fopen("enwik9-sm-comp", "wb");
-
-        huffmanEncodeWithTree(infp, outfp, &hTree);
-
-        fclose(outfp);
-        fclose(infp);
-
-        infp = fopen("enwik9-sm-comp", "rb");
-        outfp = fopen("enwik9-sm-decomp", "wb");
-
-        huffmanDecodeWithTree(infp, outfp, &hTree);
-
-        fclose(outfp);
-        fclose(infp);
-
+        // Blocked Huffman: per block code tables, counted and coded in parallel
+        TformPtr huffComp[1] = {huffmanBlockCompress};
+        TformPtr huffDecomp[1] = {huffmanBlockDecompress};
+        testCompression("enwik9-sm", 1, huffComp, huffDecomp);
     }
 
     
@@ -1,30 +1,561 @@
 
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "util.h"
 
 
 int diff_file(FILE *fp1, FILE *fp2) {
-    int c1, c2;
-    int i = 1;
-    c1 = fgetc(fp1);
-    c2 = fgetc(fp2);
-    while (c1 != EOF && c2 != EOF) {
-        if (c1 != c2)
-            return i;
-        c1 = fgetc(fp1);
-        c2 = fgetc(fp2);
-        i+=1;
+    ByteReader a, b;
+    brOpen(&a, fp1);
+    brOpen(&b, fp2);
+    // 1 based position of the first difference
+    int res = 0;
+    int at = 1;
+    for (;;) {
+        const u8* p;
+        const u8* q;
+        size_t n = brSpan(&a, &p);
+        size_t m = brSpan(&b, &q);
+        size_t k = n < m ? n : m;
+        if (k == 0) {
+            res = n != m ? at : 0;
+            break;
+        }
+        if (memcmp(p, q, k) != 0) {
+            size_t i = 0;
+            while (p[i] == q[i]) {
+                i++;
+            }
+            res = at + (int) i;
+            break;
+        }
+        brSkip(&a, k);
+        brSkip(&b, k);
+        at += (int) k;
     }
+    brClose(&a);
+    brClose(&b);
+    return res;
+}
+
+
+u8* readAll(FILE *fp, size_t *size, size_t slack) {
+    size_t spanSize;
+    const u8* span = fileSpan(fp, &spanSize);
+    if (span) {
+        // One copy straight from the span
+        long at = ftell(fp);
+        size_t n = at >= 0 && (size_t) at < spanSize ? spanSize - at : 0;
+        u8* buf = (u8*) malloc(n + slack + 1);
+        if (!buf) {
+            fprintf(stderr, "Error: Out of memory in readAll.\n");
+            exit(1);
+        }
+        memcpy(buf, span + spanSize - n, n);
+        memset(buf + n, 0, slack);
+        fseek(fp, 0, SEEK_END);
+        *size = n;
+        return buf;
+    }
+    size_t cap = 1 << 20;
+    size_t n = 0;
+    u8* buf = (u8*) malloc(cap + slack);
+    while (buf) {
+        n += fread(buf + n, 1, cap - n, fp);
+        if (n < cap) {
+            break;
+        }
+        cap *= 2;
+        buf = (u8*) realloc(buf, cap + slack);
+    }
+    if (!buf) {
+        fprintf(stderr, "Error: Out of memory in readAll.\n");
+        exit(1);
+    }
+    memset(buf + n, 0, slack);
+    *size = n;
+    return buf;
+}
+
+
+static u8* streamBuf(void) {
+    u8* buf = (u8*) malloc(STREAM_BUF_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Error: Out of memory for a stream buffer.\n");
+        exit(1);
+    }
+    return buf;
+}
+
+
+void brOpen(ByteReader* br, FILE* fp) {
+    br->fp = fp;
+    size_t size;
+    const u8* span = fileSpan(fp, &size);
+    long at = span ? ftell(fp) : -1;
+    br->inPlace = at >= 0 && (size_t) at <= size;
+    if (br->inPlace) {
+        br->buf = span;
+        br->pos = at;
+        br->end = size;
+        return;
+    }
+    br->buf = streamBuf();
+    br->pos = 0;
+    br->end = 0;
+}
+
+
+void brClose(ByteReader* br) {
+    if (br->inPlace) {
+        fseek(br->fp, (long) br->pos, SEEK_SET);
+        return;
+    }
+    free((u8*) br->buf);
+}
+
+
+size_t brFill(ByteReader* br) {
+    if (br->pos == br->end && !br->inPlace) {
+        br->end = fread((u8*) br->buf, 1, STREAM_BUF_SIZE, br->fp);
+        br->pos = 0;
+    }
+    return br->end - br->pos;
+}
+
+
+size_t brRead(ByteReader* br, u8* dst, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        const u8* span;
+        size_t avail = brSpan(br, &span);
+        if (avail == 0) {
+            break;
+        }
+        size_t k = n - done < avail ? n - done : avail;
+        memcpy(dst + done, span, k);
+        brSkip(br, k);
+        done += k;
+    }
+    return done;
+}
+
+
+void bwOpen(ByteWriter* bw, FILE* fp) {
+    bw->fp = fp;
+    bw->buf = streamBuf();
+    bw->pos = 0;
+}
+
+
+void bwFlush(ByteWriter* bw) {
+    fwrite(bw->buf, 1, bw->pos, bw->fp);
+    bw->pos = 0;
+}
+
+
+void bwClose(ByteWriter* bw) {
+    bwFlush(bw);
+    free(bw->buf);
+}
+
+
+void bwWrite(ByteWriter* bw, const u8* src, size_t n) {
+    if (n >= STREAM_BUF_SIZE) {
+        // Big writes skip the buffer
+        bwFlush(bw);
+        fwrite(src, 1, n, bw->fp);
+        return;
+    }
+    if (bw->pos + n > STREAM_BUF_SIZE) {
+        bwFlush(bw);
+    }
+    memcpy(bw->buf + bw->pos, src, n);
+    bw->pos += n;
+}
+
+
+void bwFill(ByteWriter* bw, u8 c, uint64_t count) {
+    while (count > 0) {
+        u8* span;
+        size_t n = bwSpan(bw, &span);
+        n = count < n ? count : n;
+        memset(span, c, n);
+        bwCommit(bw, n);
+        count -= n;
+    }
+}
+
+
+/*
+ *  File spans and mapped files
+ */
+#define SPAN_MAX_FILES 64
+// Space reserved ahead of a sink's writes grows by at least this much
+#define SINK_RESERVE (64 << 20)
+
+typedef struct FileSpan {
+    FILE* fp;
+    const u8* data;
+    size_t size;
+} FileSpan;
+
+typedef struct MappedFile {
+    FILE* fp;
+    u8* data;
+    size_t size;
+    size_t pos;
+} MappedFile;
+
+typedef struct SinkFile {
+    int fd;
+    off_t pos;
+    off_t end;
+    off_t reserved;
+} SinkFile;
+
+static FileSpan spans[SPAN_MAX_FILES];
+static pthread_mutex_t spanLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+void spanRegister(FILE* fp, const u8* data, size_t size) {
+    pthread_mutex_lock(&spanLock);
+    // With the table full fp just reads normally
+    for (int i=0; i < SPAN_MAX_FILES; i++) {
+        if (!spans[i].fp) {
+            spans[i].fp = fp;
+            spans[i].data = data;
+            spans[i].size = size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spanLock);
+}
+
+
+void spanForget(FILE* fp) {
+    pthread_mutex_lock(&spanLock);
+    for (int i=0; i < SPAN_MAX_FILES; i++) {
+        if (spans[i].fp == fp) {
+            spans[i].fp = NULL;
+        }
+    }
+    pthread_mutex_unlock(&spanLock);
+}
+
+
+const u8* fileSpan(FILE* fp, size_t* size) {
+    const u8* data = NULL;
+    pthread_mutex_lock(&spanLock);
+    for (int i=0; i < SPAN_MAX_FILES; i++) {
+        if (spans[i].fp == fp) {
+            data = spans[i].data;
+            *size = spans[i].size;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&spanLock);
+    return data;
+}
+
 
-    if (c1 != c2) {
-        return i;
+static ssize_t mappedRead(void* cookie, char* data, size_t size) {
+    MappedFile* m = (MappedFile*) cookie;
+    size_t n = m->size - m->pos < size ? m->size - m->pos : size;
+    memcpy(data, m->data + m->pos, n);
+    m->pos += n;
+    return n;
+}
+
+
+static int mappedSeek(void* cookie, off64_t* offset, int whence) {
+    MappedFile* m = (MappedFile*) cookie;
+    off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off64_t) m->pos : (off64_t) m->size;
+    off64_t pos = base + *offset;
+    if (pos < 0 || pos > (off64_t) m->size) {
+        return -1;
+    }
+    m->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+
+static int mappedClose(void* cookie) {
+    MappedFile* m = (MappedFile*) cookie;
+    spanForget(m->fp);
+    munmap(m->data, m->size);
+    free(m);
+    return 0;
+}
+
+
+FILE* openMapped(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    // Empty files can't be mapped
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    MappedFile* m = (MappedFile*) malloc(sizeof(MappedFile));
+    if (data == MAP_FAILED || !m) {
+        if (data != MAP_FAILED) {
+            munmap(data, st.st_size);
+        }
+        free(m);
+        return fopen(path, "rb");
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    m->data = (u8*) data;
+    m->size = st.st_size;
+    m->pos = 0;
+    cookie_io_functions_t io = {mappedRead, NULL, mappedSeek, mappedClose};
+    m->fp = fopencookie(m, "r", io);
+    if (!m->fp) {
+        munmap(data, st.st_size);
+        free(m);
+        return fopen(path, "rb");
+    }
+    spanRegister(m->fp, m->data, m->size);
+    return m->fp;
+}
+
+
+static ssize_t sinkWrite(void* cookie, const char* data, size_t size) {
+    SinkFile* s = (SinkFile*) cookie;
+    off_t need = s->pos + (off_t) size;
+    if (need > s->reserved) {
+        // Reserve well ahead so the file is laid out in big extents, failure is harmless
+        off_t grow = s->reserved > SINK_RESERVE ? s->reserved : SINK_RESERVE;
+        off_t to = need > s->reserved + grow ? need : s->reserved + grow;
+        fallocate(s->fd, FALLOC_FL_KEEP_SIZE, s->reserved, to - s->reserved);
+        s->reserved = to;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(s->fd, data + done, size - done, s->pos + done);
+        if (n <= 0) {
+            return done ? (ssize_t) done : -1;
+        }
+        done += n;
+    }
+    s->pos += done;
+    s->end = s->pos > s->end ? s->pos : s->end;
+    return done;
+}
+
+
+static int sinkSeek(void* cookie, off64_t* offset, int whence) {
+    SinkFile* s = (SinkFile*) cookie;
+    off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? s->pos : s->end;
+    off64_t pos = base + *offset;
+    if (pos < 0) {
+        return -1;
     }
+    s->pos = pos;
+    *offset = pos;
     return 0;
 }
 
 
+static int sinkClose(void* cookie) {
+    SinkFile* s = (SinkFile*) cookie;
+    // Hand back whatever was reserved past the end
+    int err = ftruncate(s->fd, s->end) | close(s->fd);
+    free(s);
+    return err ? -1 : 0;
+}
+
+
+FILE* openSink(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    SinkFile* s = (SinkFile*) calloc(1, sizeof(SinkFile));
+    cookie_io_functions_t io = {NULL, sinkWrite, sinkSeek, sinkClose};
+    FILE* fp = s ? fopencookie(s, "w", io) : NULL;
+    if (!fp) {
+        free(s);
+        close(fd);
+        return fopen(path, "wb");
+    }
+    s->fd = fd;
+    setvbuf(fp, NULL, _IOFBF, STREAM_BUF_SIZE);
+    return fp;
+}
+
+
+double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ *  Thread pool
+ *
+ *  Workers are started on first use and sleep between calls. The calling thread
+ *  works on jobs too, and parallelFor only returns once every worker is idle again
+ *  so the next call can't be mixed up with this one. The pool takes one caller at a
+ *  time, a call from another thread while it's busy runs its jobs serially. Jobs
+ *  are claimed from one counter tagged with the call's generation, so a worker that
+ *  wakes late for an old call can't take (or count) a job from the next one.
+ */
+typedef struct ThreadPool {
+    pthread_t* threads;
+    int nWorkers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t generation;
+    int nActive;
+    JobPtr fn;
+    void* ctx;
+    int nJobs;
+    // Low 32 bits of the generation above the next job index
+    uint64_t claim;
+    int nDone;
+    // Set while a caller owns the pool
+    int busy;
+} ThreadPool;
+
+static ThreadPool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+// Set while running a job, nested calls run serially
+static __thread int inJob = 0;
+
+
+// One call's work, copied under the lock
+typedef struct PoolCall {
+    uint32_t generation;
+    JobPtr fn;
+    void* ctx;
+    int nJobs;
+} PoolCall;
+
+
+static PoolCall poolSnapshot(void) {
+    PoolCall call = {(uint32_t) pool.generation, pool.fn, pool.ctx, pool.nJobs};
+    return call;
+}
+
+
+static void runJobs(PoolCall call) {
+    inJob = 1;
+    uint64_t claim = __atomic_load_n(&pool.claim, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t job = (uint32_t) claim;
+        if ((uint32_t) (claim >> 32) != call.generation || job >= (uint32_t) call.nJobs) {
+            break;
+        }
+        // Fails (and reloads claim) if another thread took the job or a new call started
+        if (__atomic_compare_exchange_n(&pool.claim, &claim, claim + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            call.fn(call.ctx, (int) job);
+            __atomic_fetch_add(&pool.nDone, 1, __ATOMIC_ACQ_REL);
+            claim++;
+        }
+    }
+    inJob = 0;
+}
+
+
+static void* poolWorker(void* arg) {
+    (void) arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        seen = pool.generation;
+        PoolCall call = poolSnapshot();
+        pool.nActive++;
+        pthread_mutex_unlock(&pool.lock);
+
+        runJobs(call);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.nActive--;
+        if (pool.nActive == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+
+static void startPool(void) {
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pool.nWorkers = numThreads() - 1;
+    pool.threads = (pthread_t*) malloc(pool.nWorkers * sizeof(pthread_t));
+    for (int i=0; i < pool.nWorkers; i++) {
+        if (pthread_create(&pool.threads[i], NULL, poolWorker, NULL) != 0) {
+            // Carry on with however many workers did start
+            pool.nWorkers = i;
+            break;
+        }
+    }
+}
+
+
+static int threadCount = 1;
+static pthread_once_t threadCountOnce = PTHREAD_ONCE_INIT;
 
 
+static void initThreadCount(void) {
+    char* env = getenv("COMP_THREADS");
+    int n = env ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    threadCount = n < 1 ? 1 : n;
+}
+
+
+int numThreads(void) {
+    pthread_once(&threadCountOnce, initThreadCount);
+    return threadCount;
+}
 
 
+void parallelFor(int nJobs, JobPtr fn, void* ctx) {
+    if (inJob || nJobs <= 1 || numThreads() == 1 ||
+        __atomic_exchange_n(&pool.busy, 1, __ATOMIC_ACQUIRE)) {
+        for (int i=0; i < nJobs; i++) {
+            fn(ctx, i);
+        }
+        return;
+    }
+    pthread_once(&poolOnce, startPool);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.nJobs = nJobs;
+    __atomic_store_n(&pool.nDone, 0, __ATOMIC_RELAXED);
+    pool.generation++;
+    PoolCall call = poolSnapshot();
+    __atomic_store_n(&pool.claim, (uint64_t) call.generation << 32, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
 
+    runJobs(call);
 
+    pthread_mutex_lock(&pool.lock);
+    while (pool.nActive > 0 || __atomic_load_n(&pool.nDone, __ATOMIC_ACQUIRE) < nJobs) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    __atomic_store_n(&pool.busy, 0, __ATOMIC_RELEASE);
+}
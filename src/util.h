@@ -5,8 +5,124 @@
 #include <stdio.h>
 
 typedef uint8_t u8;
-typedef uint8_t u64;
+typedef uint64_t u64;
 
 int diff_file(FILE *fp1, FILE *fp2);
+
+// Read the rest of a file into a malloc'd buffer followed by 'slack' zeroed bytes
+u8* readAll(FILE *fp, size_t *size, size_t slack);
+
+/*
+ *  Buffered byte streams
+ *
+ *  A ByteReader or ByteWriter keeps a STREAM_BUF_SIZE buffer in front of a FILE* so
+ *  stdio is called once per buffer instead of once per byte. Loops that can work on
+ *  many bytes at once take the buffered bytes straight from brSpan/bwSpan. A reader
+ *  reads ahead, so the FILE* can't be read directly while it's open.
+ */
+#define STREAM_BUF_SIZE (1 << 20)
+
+typedef struct ByteReader {
+    FILE* fp;
+    const u8* buf;
+    size_t pos;
+    size_t end;
+    // Set when buf is the file's span (see fileSpan) rather than our own buffer
+    int inPlace;
+} ByteReader;
+
+typedef struct ByteWriter {
+    FILE* fp;
+    u8* buf;
+    size_t pos;
+} ByteWriter;
+
+// Reads a file with a span in place, brClose moves the FILE* to where reading stopped
+void brOpen(ByteReader* br, FILE* fp);
+void brClose(ByteReader* br);
+// Refill the buffer once it's used up, returns the bytes available (0 at end of file)
+size_t brFill(ByteReader* br);
+// Copy up to n bytes to dst, returns how many there were
+size_t brRead(ByteReader* br, u8* dst, size_t n);
+
+// Next byte or EOF
+static inline int brGet(ByteReader* br) {
+    if (br->pos == br->end && brFill(br) == 0) {
+        return EOF;
+    }
+    return br->buf[br->pos++];
+}
+
+// Points span at the buffered bytes and returns how many (0 at end of file), brSkip consumes them
+static inline size_t brSpan(ByteReader* br, const u8** span) {
+    size_t n = br->end - br->pos;
+    if (n == 0) {
+        n = brFill(br);
+    }
+    *span = br->buf + br->pos;
+    return n;
+}
+
+static inline void brSkip(ByteReader* br, size_t n) {
+    br->pos += n;
+}
+
+void bwOpen(ByteWriter* bw, FILE* fp);
+// Flushes and frees the buffer, the FILE* stays open
+void bwClose(ByteWriter* bw);
+void bwFlush(ByteWriter* bw);
+void bwWrite(ByteWriter* bw, const u8* src, size_t n);
+// count copies of c
+void bwFill(ByteWriter* bw, u8 c, uint64_t count);
+
+static inline void bwPut(ByteWriter* bw, u8 c) {
+    if (bw->pos == STREAM_BUF_SIZE) {
+        bwFlush(bw);
+    }
+    bw->buf[bw->pos++] = c;
+}
+
+// Points span at free buffer space and returns its size (never 0), bwCommit keeps what was written
+static inline size_t bwSpan(ByteWriter* bw, u8** span) {
+    if (bw->pos == STREAM_BUF_SIZE) {
+        bwFlush(bw);
+    }
+    *span = bw->buf + bw->pos;
+    return STREAM_BUF_SIZE - bw->pos;
+}
+
+static inline void bwCommit(ByteWriter* bw, size_t n) {
+    bw->pos += n;
+}
+
+/*
+ *  File spans and mapped files
+ *
+ *  A FILE* can be registered with the memory holding all of its contents, and code
+ *  that would read it a buffer at a time (ByteReader, readAll, byte counting) uses
+ *  that span in place instead. The FILE* still reads and seeks normally. openMapped
+ *  maps a file and registers it, openSink writes a file with large pwrite calls into
+ *  space reserved ahead of the writes.
+ */
+void spanRegister(FILE* fp, const u8* data, size_t size);
+void spanForget(FILE* fp);
+// All of fp's contents or NULL, *size gets the length
+const u8* fileSpan(FILE* fp, size_t* size);
+
+// Read only FILE* over a mapping of path, or a plain fopen when it can't be mapped
+FILE* openMapped(const char* path);
+// Write only FILE* creating or truncating path
+FILE* openSink(const char* path);
+
+// Wall clock time for benchmarks
+double nowSeconds(void);
+
+typedef void (*JobPtr)(void* ctx, int job);
+
+// Number of threads to use, COMP_THREADS overrides the core count
+int numThreads(void);
+
+// Run fn(ctx, i) for i in [0, nJobs) on the thread pool, returns when all are done
+void parallelFor(int nJobs, JobPtr fn, void* ctx);
 #endif
 